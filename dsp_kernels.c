@@ -0,0 +1,222 @@
+// dsp_kernels.c
+// Per-pixel arithmetic on buffers of uint16_t samples, using the packed 16-bit
+// (SIMD) instructions of the DSP extension on the Cortex-M33 cores of the RP2350.
+// Each pair of samples is loaded as one 32-bit word and handled by one instruction.
+// The reference versions are plain C. They are used where the DSP extension
+// is not available (on the Hazard3 cores, for example) and, by the y command
+// of the reader, to check the packed versions on the device.
+//
+// 2026-10-16: packed 16-bit kernels, each with a scalar reference version
+//             emulated intrinsics for the host tests
+//
+#include "dsp_kernels.h"
+#include <string.h>
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+#include <arm_acle.h>
+#define DSP_KERNELS_SIMD 1
+#elif defined(DSP_KERNELS_EMULATE)
+// Host build of the tests (see tests/): the intrinsics are plain C.
+#include "arm_acle_emul.h"
+#define DSP_KERNELS_SIMD 1
+#else
+#define DSP_KERNELS_SIMD 0
+#endif
+
+#if DSP_KERNELS_SIMD
+#define ONES 0x00010001
+
+static inline uint32_t load2(const uint16_t* p)
+// The M33 allows an unaligned word load, so this is a single LDR.
+{
+	uint32_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+static inline void store2(uint16_t* p, uint32_t w)
+{
+	memcpy(p, &w, sizeof(w));
+}
+#endif
+
+uint32_t dsp_sum_u16_ref(const uint16_t* x, size_t n)
+{
+	uint32_t sum = 0;
+	for (size_t j=0; j < n; ++j) { sum += x[j]; }
+	return sum;
+}
+
+uint32_t dsp_sum_u16(const uint16_t* x, size_t n)
+{
+#if DSP_KERNELS_SIMD
+	int32_t acc = 0;
+	size_t j = 0;
+	for (; j+4 <= n; j += 4) {
+		acc = __smlad((int32_t)load2(&x[j]), ONES, acc);
+		acc = __smlad((int32_t)load2(&x[j+2]), ONES, acc);
+	}
+	uint32_t sum = (uint32_t)acc;
+	for (; j < n; ++j) { sum += x[j]; }
+	return sum;
+#else
+	return dsp_sum_u16_ref(x, n);
+#endif
+}
+
+uint64_t dsp_sumsq_u16_ref(const uint16_t* x, size_t n)
+{
+	uint64_t sumsq = 0;
+	for (size_t j=0; j < n; ++j) { sumsq += (uint32_t)x[j] * x[j]; }
+	return sumsq;
+}
+
+uint64_t dsp_sumsq_u16(const uint16_t* x, size_t n)
+{
+#if DSP_KERNELS_SIMD
+	int64_t acc = 0;
+	size_t j = 0;
+	for (; j+4 <= n; j += 4) {
+		int32_t w0 = (int32_t)load2(&x[j]);
+		int32_t w1 = (int32_t)load2(&x[j+2]);
+		acc = __smlald(w0, w0, acc);
+		acc = __smlald(w1, w1, acc);
+	}
+	uint64_t sumsq = (uint64_t)acc;
+	for (; j < n; ++j) { sumsq += (uint32_t)x[j] * x[j]; }
+	return sumsq;
+#else
+	return dsp_sumsq_u16_ref(x, n);
+#endif
+}
+
+void dsp_stats_u16_ref(const uint16_t* x, size_t n, dsp_stats_t* s)
+{
+	uint32_t sum = 0;
+	uint64_t sumsq = 0;
+	uint16_t min = 0xffff;
+	uint16_t max = 0;
+	for (size_t j=0; j < n; ++j) {
+		uint32_t v = x[j];
+		sum += v;
+		sumsq += v * v;
+		if (v < min) min = (uint16_t)v;
+		if (v > max) max = (uint16_t)v;
+	}
+	s->sum = sum;
+	s->sumsq = sumsq;
+	s->min = min;
+	s->max = max;
+}
+
+void dsp_stats_u16(const uint16_t* x, size_t n, dsp_stats_t* s)
+{
+#if DSP_KERNELS_SIMD
+	int32_t acc = 0;
+	int64_t acc_sq = 0;
+	uint32_t min2 = 0xffffffff; // smallest in each half-word lane
+	uint32_t max2 = 0;
+	size_t j = 0;
+	for (; j+2 <= n; j += 2) {
+		int32_t w = (int32_t)load2(&x[j]);
+		acc = __smlad(w, ONES, acc);
+		acc_sq = __smlald(w, w, acc_sq);
+		// USUB16 sets the GE flags of each lane for which w >= the other,
+		// then SEL picks, lane by lane, from its first operand where GE is set.
+		__usub16((uint32_t)w, max2);
+		max2 = __sel((uint32_t)w, max2);
+		__usub16((uint32_t)w, min2);
+		min2 = __sel(min2, (uint32_t)w);
+	}
+	uint32_t sum = (uint32_t)acc;
+	uint64_t sumsq = (uint64_t)acc_sq;
+	uint16_t min = (uint16_t)min2;
+	if ((min2 >> 16) < min) min = (uint16_t)(min2 >> 16);
+	uint16_t max = (uint16_t)max2;
+	if ((max2 >> 16) > max) max = (uint16_t)(max2 >> 16);
+	for (; j < n; ++j) {
+		uint32_t v = x[j];
+		sum += v;
+		sumsq += v * v;
+		if (v < min) min = (uint16_t)v;
+		if (v > max) max = (uint16_t)v;
+	}
+	s->sum = sum;
+	s->sumsq = sumsq;
+	s->min = min;
+	s->max = max;
+#else
+	dsp_stats_u16_ref(x, n, s);
+#endif
+}
+
+void dsp_accumulate_u16_ref(uint16_t* acc, const uint16_t* x, size_t n)
+{
+	for (size_t j=0; j < n; ++j) { acc[j] = (uint16_t)(acc[j] + x[j]); }
+}
+
+void dsp_accumulate_u16(uint16_t* acc, const uint16_t* x, size_t n)
+{
+#if DSP_KERNELS_SIMD
+	size_t j = 0;
+	for (; j+2 <= n; j += 2) {
+		store2(&acc[j], __uadd16(load2(&acc[j]), load2(&x[j])));
+	}
+	for (; j < n; ++j) { acc[j] = (uint16_t)(acc[j] + x[j]); }
+#else
+	dsp_accumulate_u16_ref(acc, x, n);
+#endif
+}
+
+void dsp_bin_sum_u16_ref(uint16_t* dst, const uint16_t* x, size_t nbins, unsigned factor)
+{
+	for (size_t b=0; b < nbins; ++b) {
+		uint32_t total = 0;
+		for (unsigned k=0; k < factor; ++k) { total += x[k]; }
+		x += factor;
+		dst[b] = (uint16_t)total;
+	}
+}
+
+void dsp_bin_sum_u16(uint16_t* dst, const uint16_t* x, size_t nbins, unsigned factor)
+{
+#if DSP_KERNELS_SIMD
+	if (factor < 2) {
+		memmove(dst, x, nbins*sizeof(uint16_t));
+		return;
+	}
+	for (size_t b=0; b < nbins; ++b) {
+		int32_t total = 0;
+		for (unsigned k=0; k < factor; k += 2) {
+			total = __smlad((int32_t)load2(&x[k]), ONES, total);
+		}
+		x += factor;
+		dst[b] = (uint16_t)total;
+	}
+#else
+	dsp_bin_sum_u16_ref(dst, x, nbins, factor);
+#endif
+}
+
+void dsp_dark_subtract_u16_ref(uint16_t* dst, const uint16_t* dark, const uint16_t* x, size_t n)
+{
+	for (size_t j=0; j < n; ++j) {
+		dst[j] = (uint16_t)((dark[j] > x[j]) ? dark[j] - x[j] : 0);
+	}
+}
+
+void dsp_dark_subtract_u16(uint16_t* dst, const uint16_t* dark, const uint16_t* x, size_t n)
+{
+#if DSP_KERNELS_SIMD
+	size_t j = 0;
+	for (; j+2 <= n; j += 2) {
+		// Unsigned saturating subtraction, lane by lane.
+		store2(&dst[j], __uqsub16(load2(&dark[j]), load2(&x[j])));
+	}
+	for (; j < n; ++j) {
+		dst[j] = (uint16_t)((dark[j] > x[j]) ? dark[j] - x[j] : 0);
+	}
+#else
+	dsp_dark_subtract_u16_ref(dst, dark, x, n);
+#endif
+}
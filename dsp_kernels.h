@@ -0,0 +1,50 @@
+// dsp_kernels.h
+// Per-pixel arithmetic on buffers of uint16_t samples.
+//
+// 2026-10-16: packed 16-bit kernels, each with a scalar reference version
+//
+#ifndef DSP_KERNELS_H
+#define DSP_KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The packed instructions treat each pair of samples as signed 16-bit values,
+// so the kernels are exact for samples below 32768 (12-bit ADC values and
+// summed bins of up to 8 of them). Buffers need not be word aligned.
+
+typedef struct {
+	uint32_t sum;
+	uint64_t sumsq;
+	uint16_t min;
+	uint16_t max;
+} dsp_stats_t;
+
+// Sum of the n samples.
+uint32_t dsp_sum_u16(const uint16_t* x, size_t n);
+uint32_t dsp_sum_u16_ref(const uint16_t* x, size_t n);
+
+// Sum of the squares of the n samples.
+uint64_t dsp_sumsq_u16(const uint16_t* x, size_t n);
+uint64_t dsp_sumsq_u16_ref(const uint16_t* x, size_t n);
+
+// Sum, sum of squares, smallest and largest of the n samples, in one pass.
+void dsp_stats_u16(const uint16_t* x, size_t n, dsp_stats_t* s);
+void dsp_stats_u16_ref(const uint16_t* x, size_t n, dsp_stats_t* s);
+
+// acc[j] += x[j], modulo 65536.
+// Up to 16 frames of 12-bit samples can be accumulated without overflow.
+void dsp_accumulate_u16(uint16_t* acc, const uint16_t* x, size_t n);
+void dsp_accumulate_u16_ref(uint16_t* acc, const uint16_t* x, size_t n);
+
+// dst[b] = sum of x[b*factor .. b*factor + factor-1], for nbins bins.
+// factor is 1, 2, 4, 8 or 16, and the sums must fit in 16 bits.
+void dsp_bin_sum_u16(uint16_t* dst, const uint16_t* x, size_t nbins, unsigned factor);
+void dsp_bin_sum_u16_ref(uint16_t* dst, const uint16_t* x, size_t nbins, unsigned factor);
+
+// dst[j] = dark[j] - x[j], or zero if x[j] is larger (the TCD1304 output
+// falls with exposure). dst may be the same buffer as x.
+void dsp_dark_subtract_u16(uint16_t* dst, const uint16_t* dark, const uint16_t* x, size_t n);
+void dsp_dark_subtract_u16_ref(uint16_t* dst, const uint16_t* dark, const uint16_t* x, size_t n);
+
+#endif
@@ -4,10 +4,22 @@
 # Peter J. 2025-01-07
 #          2025-01-08 Use base64 encoding of pixel data to send fewer bytes.
 #          2025-01-09 Use faster serial speed.
+#          2026-10-16 Binary packets with COBS framing and CRC-32.
+#          2026-10-16 Decoder for Rice-coded packets.
+#          2026-10-16 Reconstruction of frames from sparse updates.
+#          2026-10-16 Streaming of frames without a request for each.
+#          2026-10-16 Frame metadata from the packet header.
+#          2026-10-16 Peak lists.
+#          2026-10-16 Histogram stats.
+#          2026-10-16 Automatic exposure on the Pico2.
+#          2026-10-16 Speed of the I2C link to the driver board.
+#          2026-10-16 Abort a long command with Ctrl-C.
 #
 import argparse
 import serial
 import re
+import struct
+import zlib
 import serial.tools.list_ports as list_ports
 import matplotlib.pyplot as plt
 
@@ -59,6 +71,17 @@ def get_long_text_response(sp, nlines):
         lines.append(txt)
     return lines
 
+def get_report_lines(sp, nlines):
+    '''
+    Returns the metadata and the nlines of data of a text report (r, q or e).
+    With the metadata line turned on (see set_text_header), the report starts
+    with that line, otherwise the metadata is None.
+    '''
+    txt = get_short_text_response(sp)
+    if txt.startswith('h '):
+        return parse_text_header(txt), get_long_text_response(sp, nlines)
+    return None, [txt] + get_long_text_response(sp, nlines-1)
+
 # -----------------------------------------------------------------------------
 # Higher-level functions for interacting with the Pico2 that reads the TCD1304.
 
@@ -77,8 +100,8 @@ def sample_tcd1304_voltages(sp):
     '''
     The Pico records the TCD1304 voltages by taking 3800 ADC samples.
 
-    Returns a short report giving the average, standard-deviation
-    and time required to collect the samples.
+    Returns a short report giving the average, standard-deviation,
+    time required to collect the samples and the trigger latency.
     '''
     send_command(sp, 'b')
     txt = get_short_text_response(sp)
@@ -86,21 +109,127 @@ def sample_tcd1304_voltages(sp):
         raise RuntimeError(f'Unexpected response: {txt}')
     # print("txt=", txt)
     items = txt.split(' ')
-    return {'v_average': float(items[1]),
-            'v_stddev': float(items[2]),
-            'time_us': float(items[3])}
+    stats = {'v_average': float(items[1]),
+             'v_stddev': float(items[2]),
+             'time_us': float(items[3])}
+    if len(items) > 4:
+        # Firmware with the hardware ICG trigger also reports
+        # the measured latency from the ADC start to the first sample.
+        stats['latency_ns'] = int(items[4])
+    if len(items) > 7:
+        stats['min'] = int(items[5])
+        stats['max'] = int(items[6])
+        stats['argmax'] = int(items[7])
+    if len(items) > 8:
+        # The assumed (not measured) latency from the ICG edge to the ADC start.
+        stats['trigger_latency_ns'] = int(items[8])
+    return stats
+
+def sample_coadded_tcd1304_voltages(sp, nframes):
+    '''
+    The Pico co-adds nframes consecutive frames and keeps the per-pixel mean,
+    ready to be fetched with fetch_sampled_voltages() or
+    fetch_sampled_voltages_quickly().
+
+    Returns a short report like that of sample_tcd1304_voltages().
+    '''
+    send_command(sp, f'k {int(nframes)}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('k') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    items = txt.split(' ')
+    stats = {'v_average': float(items[1]),
+             'v_stddev': float(items[2]),
+             'time_us': float(items[3]),
+             'latency_ns': int(items[4]),
+             'nframes': int(items[5])}
+    if len(items) > 8:
+        stats['min'] = int(items[6])
+        stats['max'] = int(items[7])
+        stats['argmax'] = int(items[8])
+    if len(items) > 9:
+        stats['trigger_latency_ns'] = int(items[9])
+    return stats
+
+def take_reference_frame(sp, kind='d', nframes=16):
+    '''
+    Have the Pico2 capture a dark (kind='d') or flat (kind='f') reference frame,
+    averaged over nframes consecutive frames.
+
+    Returns the mean and standard deviation of the reference frame.
+    '''
+    assert kind in ['d', 'f'], "kind should be 'd' or 'f'"
+    send_command(sp, f'{kind} {int(nframes)}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith(kind) or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    items = txt.split(' ')
+    return {'v_average': float(items[1]), 'v_stddev': float(items[2])}
+
+def set_correction(sp, on=True):
+    '''
+    Turn on (or off) the dark and flat correction that is applied on the Pico2.
+    '''
+    send_command(sp, f'n {1 if on else 0}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('n') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return
+
+def set_sample_timing(sp, clkdiv=95.0, delay=0):
+    '''
+    clkdiv sets the ADC sample period to (1 + clkdiv) cycles of the 48MHz ADC clock;
+    0 leaves the ADC free-running.
+    delay is the number of system-clock cycles from the ICG edge to the ADC start.
+    '''
+    send_command(sp, f't {clkdiv} {int(delay)}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('t') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return
+
+def sweep_sample_phase(sp, step=10):
+    '''
+    Have the Pico2 find the sampling delay that gives the sharpest frame.
+
+    Returns the chosen delay in system-clock cycles.
+    '''
+    send_command(sp, f'T {int(step)}')
+    sp.timeout = 10.0 # The sweep takes one frame per step.
+    txt = get_short_text_response(sp)
+    sp.timeout = 1.0
+    if not txt.startswith('T') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return int(txt.split(' ')[1])
+
+def set_region_of_interest(sp, windows=[(0, 3800)]):
+    '''
+    windows is a list of (start, length) pairs, in increasing order.
+    Only the samples within these windows are reported by the Pico2.
+
+    Returns the total number of samples that will be reported.
+    '''
+    args = ' '.join(f'{int(start)} {int(length)}' for start, length in windows)
+    send_command(sp, f'w {args}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('w') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    items = [int(v) for v in txt.split(' ')[1:]]
+    return sum(items[1::2])
 
-def fetch_sampled_voltages(sp):
+def fetch_sampled_voltages(sp, nsamples=3800):
     '''
     Tell the Pico2 to actually report the sample values.
     The sample values (0-4095) are reported one per line by the Pico2.
+    nsamples is the number of samples within the region of interest.
 
-    Returns the sample values as list of floating-point values.
+    Returns the metadata (None, unless the metadata line is on)
+    and the sample values as list of floating-point values.
     '''
     send_command(sp, 'r')
-    txt_lines = get_long_text_response(sp, 3800)
+    header, txt_lines = get_report_lines(sp, nsamples)
     data = [float(v) for v in txt_lines]
-    return data
+    return header, data
 
 #   0   1   2   3   4   5   6   7   8   9  10  11  12  13  14  15
 base64_alphabet = [
@@ -113,29 +242,439 @@ base64_values = {}
 for i in range(len(base64_alphabet)):
     base64_values[base64_alphabet[i]] = i
 
-def decode_base64_text_line(txt):
+def decode_base64_text_line(txt, nchars=2):
+    '''
+    Each value is encoded as nchars base64 characters, most-significant first.
+    '''
     data = []
-    for k in range(20):
-        hi = base64_values[txt[2*k]]
-        lo = base64_values[txt[2*k+1]]
-        data.append(float(hi*64+lo))
+    for k in range(len(txt)//nchars):
+        v = 0
+        for c in txt[nchars*k:nchars*(k+1)]:
+            v = v*64 + base64_values[c]
+        data.append(float(v))
     return data
 
-def fetch_sampled_voltages_quickly(sp):
+def fetch_sampled_voltages_quickly(sp, nsamples=3800, wide=False):
     '''
     Tell the Pico2 to actually report the sample values.
     The 12-bit sample values (0-4095) are reported by the Pico2
     as pairs of base64 characters, 20 values per line.
+    nsamples is the number of (binned) values in the report.
+    wide should be True when summed bins are reported,
+    in which case there are three characters per value.
 
-    Returns the sample values as list of floating-point values.
+    Returns the metadata (None, unless the metadata line is on)
+    and the sample values as list of floating-point values.
     '''
     send_command(sp, 'q')
-    txt_lines = get_long_text_response(sp, 3800/20)
+    header, txt_lines = get_report_lines(sp, (nsamples+19)//20)
     data = []
     for txt in txt_lines:
-        data.extend(decode_base64_text_line(txt))
+        data.extend(decode_base64_text_line(txt, 3 if wide else 2))
+    return header, data
+
+# Binary reports come as packets that are framed with COBS,
+# with a zero byte before and after each packet.
+PKT_FORMAT_PACKED12 = 1
+PKT_FORMAT_U16 = 2
+PKT_FORMAT_RICE = 3
+PKT_FORMAT_SPARSE = 4
+RICE_BLOCK = 32
+RICE_QMAX = 20
+RICE_ESCAPE_BITS = 18
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0:
+            raise ValueError('Zero byte within COBS data')
+        i += 1
+        out.extend(data[i:i+code-1])
+        i += code-1
+        if code < 0xff and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+def get_packet(sp):
+    '''
+    Returns the (decoded) bytes of the next packet that has a good CRC,
+    or None if the serial port times out.
+    Bad packets, and any junk between packets, are skipped.
+    '''
+    while True:
+        chunk = sp.read_until(b'\x00')
+        if not chunk.endswith(b'\x00'):
+            return None
+        if len(chunk) == 1:
+            continue # an empty packet, between delimiters
+        try:
+            pkt = cobs_decode(chunk[:-1])
+        except ValueError:
+            continue
+        if len(pkt) < 12:
+            continue
+        crc = struct.unpack('<I', pkt[-4:])[0]
+        if crc != zlib.crc32(pkt[:-4]):
+            print('Skipping packet with bad CRC.')
+            continue
+        return pkt[:-4]
+
+def parse_packet_header(pkt):
+    '''
+    Returns a dictionary of the header fields and the payload bytes.
+    '''
+    fmt, hdr_len, nvalues, seq = struct.unpack('<BBHI', pkt[:8])
+    header = {'format': fmt, 'nvalues': nvalues, 'seq': seq}
+    if hdr_len >= 28:
+        start_us, duration_us, sh_us, icg_us, lost = struct.unpack('<QIHHI', pkt[8:28])
+        header.update({'start_us': start_us, 'duration_us': duration_us,
+                       'sh_us': sh_us, 'icg_us': icg_us, 'lost': lost})
+    return header, pkt[hdr_len:]
+
+def unpack12(payload, nvalues):
+    data = []
+    for j in range(0, nvalues-1, 2):
+        b0, b1, b2 = payload[3*(j//2):3*(j//2)+3]
+        data.append(float(b0 | ((b1 & 0x0f) << 8)))
+        data.append(float((b1 >> 4) | (b2 << 4)))
+    if nvalues % 2:
+        k = 3*(nvalues//2)
+        data.append(float(payload[k] | (payload[k+1] << 8)))
+    return data
+
+def rice_decode(payload, nvalues):
+    '''
+    The first value is 16 bits, then the differences between neighbouring values
+    are Rice coded in blocks, each with its own parameter k.
+    See rice_encode() in the firmware.
+    '''
+    if nvalues == 0: return []
+    value = payload[0] | (payload[1] << 8)
+    data = [float(value)]
+    bits = int.from_bytes(payload[2:], 'big')
+    nbits = 8*(len(payload)-2)
+    pos = 0
+    def read(n):
+        nonlocal pos
+        pos += n
+        return (bits >> (nbits - pos)) & ((1 << n) - 1)
+    j = 1
+    while j < nvalues:
+        k = read(5)
+        for _ in range(min(RICE_BLOCK, nvalues-j)):
+            q = 0
+            while q < RICE_QMAX and read(1) == 1:
+                q += 1
+            if q == RICE_QMAX:
+                u = read(RICE_ESCAPE_BITS)
+            else:
+                u = (q << k) | read(k) if k > 0 else q
+            r = (u >> 1) ^ -(u & 1)
+            value += r
+            data.append(float(value))
+            j += 1
     return data
 
+def decode_frame_packet(pkt):
+    '''
+    Returns the header fields and the sample values as a list of floating-point values.
+    '''
+    header, payload = parse_packet_header(pkt)
+    n = header['nvalues']
+    if header['format'] == PKT_FORMAT_PACKED12:
+        data = unpack12(payload, n)
+    elif header['format'] == PKT_FORMAT_U16:
+        data = [float(v) for v in struct.unpack(f'<{n}H', payload[:2*n])]
+    elif header['format'] == PKT_FORMAT_RICE:
+        data = rice_decode(payload, n)
+    else:
+        raise RuntimeError(f"Unexpected packet format: {header['format']}")
+    return header, data
+
+def fetch_sampled_voltages_binary(sp):
+    '''
+    Tell the Pico2 to report the sample values as a binary packet,
+    with the 12-bit values packed two into 3 bytes.
+
+    Returns the header fields and the sample values as list of floating-point values.
+    '''
+    send_command(sp, 'Q')
+    pkt = get_packet(sp)
+    if pkt is None:
+        raise RuntimeError('No packet received')
+    return decode_frame_packet(pkt)
+
+def fetch_sampled_voltages_compressed(sp):
+    '''
+    Tell the Pico2 to report the sample values as a Rice-coded binary packet.
+    (The Pico2 sends a packed packet instead if that would be smaller.)
+
+    Returns the header fields and the sample values as list of floating-point values.
+    '''
+    send_command(sp, 'z')
+    pkt = get_packet(sp)
+    if pkt is None:
+        raise RuntimeError('No packet received')
+    return decode_frame_packet(pkt)
+
+class SparseReceiver:
+    '''
+    Keeps the frame as last reported by the Pico2 and applies
+    the sparse updates to it.
+    The updates have the same value width as the last keyframe,
+    16 bits (summed bins) or 12 bits, as given by its format.
+    '''
+    def __init__(self):
+        self.data = None
+        self.seq = None
+        self.wide = False
+
+    def apply(self, pkt):
+        '''
+        Returns the header fields and the reconstructed frame,
+        or raises RuntimeError if the update does not apply to the frame we have.
+        '''
+        header, payload = parse_packet_header(pkt)
+        if header['format'] != PKT_FORMAT_SPARSE:
+            # A keyframe.
+            header, self.data = decode_frame_packet(pkt)
+            self.seq = header['seq']
+            self.wide = (header['format'] == PKT_FORMAT_U16)
+            return header, list(self.data)
+        ref_seq, nruns = struct.unpack('<IH', payload[:6])
+        if self.data is None or ref_seq != self.seq or len(self.data) != header['nvalues']:
+            self.data = None
+            raise RuntimeError('Sparse update does not match our reference frame')
+        pos = 6
+        for _ in range(nruns):
+            start, count = struct.unpack('<HH', payload[pos:pos+4])
+            pos += 4
+            if self.wide:
+                nbytes = 2*count
+                values = [float(v) for v in struct.unpack(f'<{count}H', payload[pos:pos+nbytes])]
+            else:
+                nbytes = 3*(count//2) + 2*(count%2)
+                values = unpack12(payload[pos:pos+nbytes], count)
+            pos += nbytes
+            self.data[start:start+count] = values
+        self.seq = header['seq']
+        return header, list(self.data)
+
+def fetch_sampled_voltages_sparse(sp, receiver):
+    '''
+    Tell the Pico2 to report the sample values as a sparse update
+    (or a keyframe) and apply that to the receiver's copy of the frame.
+    If the update cannot be applied, a keyframe is requested.
+
+    Returns the header fields and the sample values as list of floating-point values.
+    '''
+    send_command(sp, 'u')
+    pkt = get_packet(sp)
+    if pkt is None:
+        raise RuntimeError('No packet received')
+    try:
+        return receiver.apply(pkt)
+    except RuntimeError:
+        send_command(sp, 'U')
+        get_short_text_response(sp)
+        send_command(sp, 'u')
+        pkt = get_packet(sp)
+        if pkt is None:
+            raise RuntimeError('No packet received')
+        return receiver.apply(pkt)
+
+def set_text_header(sp, on=True):
+    '''
+    Turn on or off the metadata line at the start of the r, q and e reports.
+    The fetch functions return the metadata alongside the data.
+    '''
+    send_command(sp, f'h {int(on)}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('h') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return
+
+def parse_text_header(txt):
+    '''
+    Returns the metadata from the line that starts the r, q and e reports.
+    '''
+    items = txt.strip().split(' ')
+    if items[0] != 'h' or len(items) < 7:
+        raise RuntimeError(f'Unexpected metadata line: {txt}')
+    keys = ['seq', 'start_us', 'duration_us', 'sh_us', 'icg_us', 'lost']
+    return dict(zip(keys, [int(v) for v in items[1:7]]))
+
+def set_peak_detection(sp, threshold=200, prominence=100, refinement='p'):
+    '''
+    threshold and prominence are in ADC counts of the light signal.
+    refinement is 'p' for a parabolic fit or 'c' for a centroid.
+    '''
+    send_command(sp, f'E {int(threshold)} {int(prominence)} {refinement}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('E') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return
+
+def parse_peak_line(txt):
+    '''
+    Returns the frame sequence number and a list of (position, height, prominence).
+    '''
+    items = txt.strip().split(' ')
+    if items[0] != 'e':
+        raise RuntimeError(f'Unexpected peak line: {txt}')
+    seq = int(items[1])
+    npeaks = int(items[2])
+    peaks = []
+    for m in range(npeaks):
+        pos, height, prominence = items[3+3*m:6+3*m]
+        peaks.append((float(pos), float(height), int(prominence)))
+    return seq, peaks
+
+def fetch_peaks(sp):
+    '''
+    Tell the Pico2 to report the peaks in the present frame.
+
+    Returns the metadata (None, unless the metadata line is on),
+    the frame sequence number and the list of peaks.
+    '''
+    send_command(sp, 'e')
+    header, txt_lines = get_report_lines(sp, 1)
+    seq, peaks = parse_peak_line(txt_lines[0])
+    return header, seq, peaks
+
+def fetch_histogram_stats(sp, percentiles=(1, 5, 50, 95, 99)):
+    '''
+    Returns the min, max, saturated and dark counts of the light signal
+    in the present frame, and a dictionary of values at the percentiles
+    (which should be those last set with set_histogram_levels).
+    '''
+    send_command(sp, 'g')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('g') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    items = [int(v) for v in txt.split(' ')[1:]]
+    stats = {'min': items[0], 'max': items[1], 'saturated': items[2], 'dark': items[3]}
+    stats['percentiles'] = dict(zip(percentiles, items[4:]))
+    return stats
+
+def set_histogram_levels(sp, sat_level=4000, dark_level=50, percentiles=(1, 5, 50, 95, 99)):
+    send_command(sp, f'G {int(sat_level)} {int(dark_level)} ' + ' '.join(str(p) for p in percentiles))
+    txt = get_short_text_response(sp)
+    if not txt.startswith('G') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return
+
+def set_auto_exposure(sp, target=3000, percentile=99):
+    '''
+    The Pico2 adjusts the SH period so that the light signal at the percentile
+    is near the target level. A target of 0 turns automatic exposure off.
+
+    Returns the SH and ICG periods in force.
+    '''
+    send_command(sp, f'A {int(target)} {percentile}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('A') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    items = txt.split(' ')
+    return int(items[3]), int(items[4])
+
+def set_stream_queue(sp, depth=2, policy='o'):
+    '''
+    depth is the number of frames that the Pico2 may hold while waiting to send them.
+    policy is 'o' to drop the oldest frame when the queue is full, 'n' to drop the newest.
+    '''
+    send_command(sp, f'm {int(depth)} {policy}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('m') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return
+
+def start_stream(sp, every=1, fmt='Q'):
+    '''
+    Tell the Pico2 to report every Nth frame, as a packet of format fmt
+    ('Q', 'z' or 'u'), until stop_stream is called.
+    Use get_stream_frame (or, for 'u', a SparseReceiver) to collect the frames.
+    '''
+    send_command(sp, f's {int(every)} {fmt}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('s') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return
+
+def get_stream_frame(sp, receiver=None):
+    '''
+    Returns the header fields and the sample values of the next streamed frame.
+    '''
+    pkt = get_packet(sp)
+    if pkt is None:
+        raise RuntimeError('No packet received')
+    if receiver is not None:
+        return receiver.apply(pkt)
+    return decode_frame_packet(pkt)
+
+def stop_stream(sp):
+    '''
+    Returns the number of frames sent and the number dropped by the Pico2.
+    Packets that were already on their way are discarded.
+    '''
+    send_command(sp, 's 0')
+    while True:
+        txt = sp.readline().decode('utf-8', errors='replace')
+        if not txt:
+            raise RuntimeError('No response to stop command')
+        i = txt.find('s 0 ')
+        if i >= 0:
+            items = txt[i:].strip().split(' ')
+            return int(items[2]), int(items[3])
+
+def set_binning(sp, factor=1, mode='a'):
+    '''
+    factor is the number of adjacent samples in each bin (1, 2, 4, 8 or 16).
+    mode is 'a' to average the samples in each bin or 's' to sum them.
+
+    Returns the number of values in a report.
+    '''
+    send_command(sp, f'x {int(factor)} {mode}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('x') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return int(txt.split(' ')[3])
+
+def abort_command(sp):
+    '''
+    Ctrl-C gets the Pico2 to give up on a command that is waiting on frames
+    (for example, b with no ICG signal or a long k) and to stop any stream.
+    The response to the aborted command is left for the caller to read.
+    '''
+    sp.write(b'\x03')
+    return
+
+def get_input_status(sp, reset=False):
+    '''
+    Returns the number of characters waiting in the Pico2's input buffer
+    and the number dropped because it was full, optionally resetting the latter.
+    '''
+    send_command(sp, 'i 0' if reset else 'i')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('i') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    items = txt.split(' ')
+    return {'waiting': int(items[1]), 'dropped': int(items[2])}
+
+def set_i2c_speed(sp, khz=100):
+    '''
+    Faster than 100 kHz needs external pull-up resistors on SDA and SCL.
+
+    Returns the actual rate in Hz.
+    '''
+    send_command(sp, f'I {int(khz)}')
+    txt = get_short_text_response(sp)
+    if not txt.startswith('I') or txt.find('error') >= 0:
+        raise RuntimeError(f'Unexpected response: {txt}')
+    return int(txt.split(' ')[1])
+
 def set_SH_ICG_periods(sp, sh_us=200, icg_us=10000):
     '''
     sh_us sets the exposure period in microseconds
@@ -194,7 +733,7 @@ if __name__ == '__main__':
         # First collection of pixel data.
         stats = sample_tcd1304_voltages(sp)
         print(f"stats={stats}")
-        data = fetch_sampled_voltages_quickly(sp)
+        header, data = fetch_sampled_voltages_quickly(sp)
         N = len(data)
         print(f"number of samples = {N}")
         line1, = ax.plot(data)
@@ -204,7 +743,7 @@ if __name__ == '__main__':
             while True:
                 stats = sample_tcd1304_voltages(sp)
                 print(f"stats={stats}")
-                data = fetch_sampled_voltages_quickly(sp)
+                header, data = fetch_sampled_voltages_quickly(sp)
                 line1.set_ydata(data)
                 fig.canvas.flush_events()
         except KeyboardInterrupt:
@@ -8,84 +8,2066 @@
 //    2025-01-01: added period-setting command (via I2C to driver board)
 //    2025-01-08: quick reporting of pixel data, using base64 encoding
 //    2025-01-09: run the serial port faster
+//    2026-10-16: DMA transfers from the ADC FIFO, paced by the ADC DREQ
+//    2026-10-16: double-buffered frames, next capture armed on the ICG edge
+//    2026-10-16: ICG edge starts the ADC via PIO and DMA, latency measured
+//    2026-10-16: acquisition runs on core1, frames handed to core0 via queues
+//    2026-10-16: co-adding of consecutive frames on the Pico2
+//    2026-10-16: dark-frame and flat-field correction on the Pico2
+//    2026-10-16: ADC clock divider and sampling phase, with phase sweep
+//    2026-10-16: region-of-interest windows for reporting
+//    2026-10-16: binning of adjacent samples for reporting
+//    2026-10-16: packed binary report in COBS-framed packets with CRC-32
+//    2026-10-16: compressed report, Rice-coded differences between samples
+//    2026-10-16: sparse-update report, only the samples that have changed
+//    2026-10-16: optional native-USB data path, UART kept as the console
+//    2026-10-16: reports built in a buffer and sent to the UART by DMA
+//    2026-10-16: table-driven base64 encoder, with a benchmark command
+//    2026-10-16: digit-pair decimal encoder for the r report
+//    2026-10-16: streaming of every Nth frame, with a queue depth and drop policy
+//    2026-10-16: metadata for each reported frame, with a 64-bit timestamp
+//    2026-10-16: single-pass integer stats, computed as the samples land
+//    2026-10-16: packed 16-bit (DSP) kernels for stats, correction, co-adding, binning
+//    2026-10-16: peak detection, with sub-pixel positions
+//    2026-10-16: histogram of the light signal, with percentiles and saturation count
+//    2026-10-16: automatic exposure control, adjusting SH on the Pico2
+//    2026-10-16: interrupt-driven I2C link to the PIC18, with selectable speed
+//    2026-10-16: UART receive ring buffer, filled under interrupt, and Ctrl-C abort
 //
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
 #include "hardware/adc.h"
 #include "hardware/uart.h"
 #include "hardware/i2c.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/pwm.h"
+#include "hardware/clocks.h"
+#include "hardware/timer.h"
+#include "hardware/structs/systick.h"
 #include "pico/binary_info.h"
+#include "pico/multicore.h"
+#if TCD1304_USB_DATA
+#include "pico/stdio_usb.h"
+#include "pico/stdio_uart.h"
+#endif
+#include "hardware/sync.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 
-#define VERSION_STR "v0.4 2025-01-09 TCD1304DG linear-image-sensor reader"
+#include "icg_trigger.pio.h"
+#include "dsp_kernels.h"
+
+#define VERSION_STR "v0.5 2026-10-16 TCD1304DG linear-image-sensor reader"
 
 const uint LED_PIN = PICO_DEFAULT_LED_PIN;
 uint8_t override_led = 0;
 const uint ICG_PIN = 16;
 
-// I2C communication with PIC18F16Q41 driver board.
-const uint SDA_PIN = 20;
-const uint SCL_PIN = 21;
-uint8_t msg_bytes[4];
+// I2C communication with PIC18F16Q41 driver board.
+const uint SDA_PIN = 20;
+const uint SCL_PIN = 21;
+uint8_t msg_bytes[4];
+
+// We want to capture a batch of samples.
+const uint ADC_PIN = 26;
+#define N_SAMPLES 3800
+
+// Frames are captured into a small pool of buffers.
+// Core 1 acquires every ICG frame into a free buffer, computes its stats
+// and passes it to core 0 through the ready queue.
+// The interpreter on core 0 holds one frame (for reporting by b, r, q)
+// and returns frames to core 1 through the free queue.
+// While the interpreter is busy reporting one frame, core 1 keeps capturing.
+// When streaming, core 0 may also hold a few frames waiting to be sent.
+typedef struct {
+	uint16_t samples[N_SAMPLES];
+	uint32_t seq;        // frame sequence number, counting every ICG period
+	uint32_t start_us;   // time of the ICG rising edge
+	uint64_t start_us64; // the same, extended to 64 bits so that it does not wrap
+	uint32_t time_taken; // microseconds from ICG edge to last sample
+	uint32_t edge_ctr;   // stamp-counter value just after the ADC was started
+	uint32_t first_ctr;  // stamp-counter value when the first sample landed
+	uint32_t icg_delay;  // system-clock cycles from ICG edge to ADC start, in force
+	float mean;
+	float stddev;
+	uint16_t min;
+	uint16_t max;
+	uint16_t argmax;     // index of the (first) largest sample
+	uint16_t sh_us;      // SH and ICG periods in force
+	uint16_t icg_us;
+	bool corrected;      // dark and flat correction has been applied
+} frame_t;
+
+#define N_FRAMES 8
+frame_t frames[N_FRAMES];
+frame_t spare_frame; // Captured into, and then dropped, if no buffer is free.
+frame_t *report_frame = &frames[0];  // owned by the interpreter (b, r, q)
+frame_t *capture_frame = &spare_frame; // owned by the capture machinery on core 1
+volatile uint32_t frames_dropped = 0; // written only by core 1
+
+// Single-producer, single-consumer queue of frame pointers.
+// The producer only writes head and the consumer only writes tail,
+// so the two cores can share a queue without a lock.
+#define FRAME_QUEUE_LEN 8 // power of 2, at least N_FRAMES
+typedef struct {
+	frame_t* volatile slot[FRAME_QUEUE_LEN];
+	volatile uint32_t head; // count of frames pushed
+	volatile uint32_t tail; // count of frames popped
+} frame_queue_t;
+
+frame_queue_t free_frames;  // core 0 -> core 1
+frame_queue_t ready_frames; // core 1 -> core 0
+
+bool __not_in_flash_func(frame_queue_push)(frame_queue_t* q, frame_t* f)
+{
+	uint32_t h = q->head;
+	if (h - q->tail == FRAME_QUEUE_LEN) return false;
+	q->slot[h % FRAME_QUEUE_LEN] = f;
+	__dmb(); // The slot must be visible before the new head.
+	q->head = h + 1;
+	return true;
+}
+
+frame_t* __not_in_flash_func(frame_queue_pop)(frame_queue_t* q)
+{
+	uint32_t t = q->tail;
+	if (q->head == t) return NULL;
+	__dmb(); // Read the slot only after seeing the new head.
+	frame_t* f = q->slot[t % FRAME_QUEUE_LEN];
+	__dmb();
+	q->tail = t + 1;
+	return f;
+}
+
+volatile bool capture_done = false;
+
+// The capture is started in hardware.
+// A PIO state machine watches ICG and, on the rising edge, pushes a word
+// that a DMA channel (trig) writes to the ADC CS register to set START_MANY.
+// The trig channel chains to channels that stamp the edge time.
+// The ADC FIFO is drained by a pair of DMA channels that are paced by the ADC DREQ.
+// The first takes just sample 0 and chains to a stamp channel,
+// which in turn chains to the channel that takes the rest of the frame.
+// The CPU is not involved from the ICG edge until the last sample has landed.
+//
+// A spare PWM slice, free-running at the system clock, is used as a
+// fine-grained counter so that the edge-to-first-sample latency can be measured.
+const uint STAMP_PWM_SLICE = 11; // Not connected to any pin on the RP2350A.
+PIO icg_pio = pio0;
+uint icg_sm;
+int trig_dma_chan;
+int edge_ctr_dma_chan;
+int edge_us_dma_chan;
+int adc_first_dma_chan;
+int first_ctr_dma_chan;
+int adc_dma_chan;
+
+void __not_in_flash_func(adc_dma_irq_handler)()
+// Runs when the last sample of a frame has landed.
+{
+	if (!dma_channel_get_irq0_status(adc_dma_chan)) return;
+	dma_channel_acknowledge_irq0(adc_dma_chan);
+	adc_run(false);
+	adc_fifo_drain();
+	capture_frame->time_taken = time_us_32() - capture_frame->start_us;
+	capture_done = true;
+}
+
+dma_channel_config stamp_dma_config(int chan)
+// A single 32-bit copy from a peripheral register to memory.
+{
+	dma_channel_config c = dma_channel_get_default_config(chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, false);
+	return c;
+}
+
+void capture_init()
+{
+	pwm_config pc = pwm_get_default_config();
+	pwm_config_set_clkdiv_int(&pc, 1);
+	pwm_init(STAMP_PWM_SLICE, &pc, true);
+	//
+	icg_sm = pio_claim_unused_sm(icg_pio, true);
+	uint offset = pio_add_program(icg_pio, &icg_trigger_program);
+	icg_trigger_program_init(icg_pio, icg_sm, offset, ICG_PIN, ADC_CS_START_MANY_BITS);
+	//
+	trig_dma_chan = dma_claim_unused_channel(true);
+	edge_ctr_dma_chan = dma_claim_unused_channel(true);
+	edge_us_dma_chan = dma_claim_unused_channel(true);
+	adc_first_dma_chan = dma_claim_unused_channel(true);
+	first_ctr_dma_chan = dma_claim_unused_channel(true);
+	adc_dma_chan = dma_claim_unused_channel(true);
+	dma_channel_set_irq0_enabled(adc_dma_chan, true);
+	irq_set_exclusive_handler(DMA_IRQ_0, adc_dma_irq_handler);
+	irq_set_enabled(DMA_IRQ_0, true);
+}
+
+void __not_in_flash_func(arm_capture)()
+// The capture into capture_frame will start on the next ICG rising edge.
+// The channels are configured from the far end of each chain
+// so that nothing can be triggered before it is ready.
+{
+	frame_t* f = capture_frame;
+	capture_done = false;
+	adc_fifo_drain();
+	//
+	dma_channel_config c = dma_channel_get_default_config(adc_dma_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_dreq(&c, DREQ_ADC);
+	dma_channel_configure(adc_dma_chan, &c, &f->samples[1], &adc_hw->fifo, N_SAMPLES-1, false);
+	c = stamp_dma_config(first_ctr_dma_chan);
+	channel_config_set_chain_to(&c, adc_dma_chan);
+	dma_channel_configure(first_ctr_dma_chan, &c, &f->first_ctr, &pwm_hw->slice[STAMP_PWM_SLICE].ctr, 1, false);
+	c = dma_channel_get_default_config(adc_first_dma_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, DREQ_ADC);
+	channel_config_set_chain_to(&c, first_ctr_dma_chan);
+	dma_channel_configure(adc_first_dma_chan, &c, &f->samples[0], &adc_hw->fifo, 1, true);
+	//
+	c = stamp_dma_config(edge_us_dma_chan);
+	dma_channel_configure(edge_us_dma_chan, &c, &f->start_us, &timer_hw->timerawl, 1, false);
+	c = stamp_dma_config(edge_ctr_dma_chan);
+	channel_config_set_chain_to(&c, edge_us_dma_chan);
+	dma_channel_configure(edge_ctr_dma_chan, &c, &f->edge_ctr, &pwm_hw->slice[STAMP_PWM_SLICE].ctr, 1, false);
+	c = stamp_dma_config(trig_dma_chan);
+	channel_config_set_dreq(&c, pio_get_dreq(icg_pio, icg_sm, false));
+	channel_config_set_chain_to(&c, edge_ctr_dma_chan);
+	pio_sm_clear_fifos(icg_pio, icg_sm); // discard any stale edge
+	dma_channel_configure(trig_dma_chan, &c, hw_set_alias_untyped(&adc_hw->cs),
+						  &icg_pio->rxf[icg_sm], 1, true);
+}
+
+// System-clock cycles from the ICG edge at the pin to the edge_ctr stamp,
+// not counting the programmed delay (see icg_trigger.pio):
+// 2 for the input synchronizer, 1 to leave the wait, 1 for the last pass of
+// the delay loop, 2 for mov and push, then about 4 for each of the DMA write
+// to the ADC and the chained read of the stamp counter.
+// This is an estimate from the instruction counts; it is not measured.
+#define ICG_EDGE_TO_STAMP_CYCLES 14
+
+static inline uint32_t cycles_to_ns(uint32_t counts)
+{
+	return (uint32_t)((uint64_t)counts * 1000000000u / clock_get_hz(clk_sys));
+}
+
+uint32_t frame_latency_ns(const frame_t* f)
+// Measured time from the ADC being started to the first sample landing in memory.
+// The stamp counter is only 16 bits but the latency is only a few hundred counts.
+{
+	return cycles_to_ns((f->first_ctr - f->edge_ctr) & 0xffff);
+}
+
+uint32_t frame_trigger_latency_ns(const frame_t* f)
+// Time from the ICG rising edge at the pin to the ADC being started,
+// from the fixed (assumed) latency of the PIO and DMA and the programmed delay.
+// Added to frame_latency_ns, it gives the time from the ICG edge to the first sample.
+{
+	return cycles_to_ns(ICG_EDGE_TO_STAMP_CYCLES + f->icg_delay);
+}
+
+// Frame stats in a single pass, in integer arithmetic.
+// Core 1 adds the samples into the accumulators as they land,
+// so that the stats are ready soon after the last sample.
+typedef struct {
+	uint64_t sum;
+	uint64_t sumsq;
+	uint16_t min;
+	uint16_t max;
+	uint16_t argmax;
+} stats_acc_t;
+
+void stats_begin(stats_acc_t* a)
+{
+	a->sum = 0;
+	a->sumsq = 0;
+	a->min = 0xffff;
+	a->max = 0;
+	a->argmax = 0;
+}
+
+void __not_in_flash_func(stats_add)(stats_acc_t* a, const uint16_t* samples, size_t from, size_t to)
+// The packed kernel finds the largest value; only then do we look for where it is.
+{
+	if (to <= from) return;
+	dsp_stats_t s;
+	dsp_stats_u16(&samples[from], to - from, &s);
+	a->sum += s.sum;
+	a->sumsq += s.sumsq;
+	if (s.min < a->min) a->min = s.min;
+	if (s.max > a->max) {
+		size_t j = from;
+		while (samples[j] != s.max) { j++; }
+		a->max = s.max;
+		a->argmax = (uint16_t)j;
+	}
+}
+
+void stats_finish(frame_t* f, const stats_acc_t* a)
+// With n samples, the variance is (n*sumsq - sum*sum) / (n*(n-1)).
+// The numerator is exact in 64 bits for up to 65536 samples of 12 bits.
+{
+	uint64_t n = N_SAMPLES;
+	uint64_t numerator = n*a->sumsq - a->sum*a->sum;
+	f->mean = (float)a->sum / (float)n;
+	f->stddev = sqrtf((float)numerator / (float)(n*(n-1)));
+	f->min = a->min;
+	f->max = a->max;
+	f->argmax = a->argmax;
+}
+
+void frame_stats(frame_t* f)
+{
+	stats_acc_t acc;
+	stats_begin(&acc);
+	stats_add(&acc, f->samples, 0, N_SAMPLES);
+	stats_finish(f, &acc);
+}
+
+void frame_stats_simple(frame_t* f)
+// Two passes in floating point.
+// This is the straight-forward version, kept as the reference for the benchmark.
+{
+	float n = (float)N_SAMPLES;
+	float mean = 0;
+	for (size_t j=0; j < N_SAMPLES; ++j) {
+		mean += (float)f->samples[j];
+	}
+	mean /= n;
+	float variance = 0;
+	for (size_t j=0; j < N_SAMPLES; ++j) {
+		float diff = (float)f->samples[j] - mean;
+		variance += diff * diff;
+	}
+	f->mean = mean;
+	f->stddev = sqrt(variance/(n-1.0f));
+}
+
+// Dark-frame and flat-field correction, applied on core 1 before the stats.
+// The TCD1304 output voltage falls with exposure, so the corrected value is
+//   ((dark - raw) * gain) >> 14, clamped to 0..4095,
+// which is zero for a dark pixel and increases with light.
+// The gain (Q14 fixed point) scales each pixel of the flat reference
+// to the mean level of that reference.
+// Core 1 only reads the references while correction_wanted is set, and
+// core 0 only writes them after seeing a frame that was not corrected.
+#define GAIN_ONE (1u << 14)
+uint16_t dark_ref[N_SAMPLES];
+uint16_t flat_gain[N_SAMPLES];
+bool have_dark_ref = false;
+bool have_flat_ref = false;
+volatile bool correction_wanted = false;
+
+void __not_in_flash_func(correct_samples)(frame_t* f, size_t from, size_t to)
+// Without a flat reference, the gain is unity and the (dark) signal
+// is no larger than the dark reference, so there is no need to clamp.
+{
+	if (to <= from) return;
+	dsp_dark_subtract_u16(&f->samples[from], &dark_ref[from], &f->samples[from], to - from);
+	if (!have_flat_ref) return;
+	for (size_t j=from; j < to; ++j) {
+		uint32_t v = ((uint32_t)f->samples[j] * flat_gain[j]) >> 14;
+		f->samples[j] = (uint16_t)((v > 4095) ? 4095 : v);
+	}
+}
+
+// Sample timing, requested by core 0 and applied by core 1 between frames.
+// With adc_clkdiv zero, the ADC is free-running at 500 ksps (96 ADC clocks
+// per conversion). Otherwise a conversion is started every (1 + adc_clkdiv)
+// cycles of the 48MHz ADC clock, with a resolution of 1/256 cycle, so the
+// sample rate can be trimmed to the pixel rate of the sensor.
+// icg_delay is the number of system-clock cycles from the ICG edge to the
+// start of the ADC and so sets the phase of the samples within each pixel.
+#define PIXEL_RATE_HZ 500000 // fM/4, with the 2MHz master clock from the PIC18
+volatile float adc_clkdiv = 0.0f;
+volatile uint32_t icg_delay = 0;
+uint32_t applied_icg_delay = 0; // the delay actually in the state machine, owned by core 1
+volatile bool timing_changed = true;
+volatile uint32_t timing_seq = 0; // first frame captured with the new timing
+
+// SH and ICG periods (microseconds) as last sent to the driver board,
+// starting with the default values in the PIC18 MCU.
+// Core 1 records them in each frame. The record is only right for frames
+// that started once the new periods were certainly in force, and only
+// those frames are handed out (see frame_periods_settled).
+volatile uint16_t period_sh_us = 200;
+volatile uint16_t period_icg_us = 10000;
+
+void apply_timing()
+{
+	adc_set_clkdiv(adc_clkdiv);
+	icg_trigger_set_delay(icg_pio, icg_sm, icg_delay);
+	applied_icg_delay = icg_delay;
+}
+
+size_t __not_in_flash_func(samples_landed)(const frame_t* f)
+// The number of samples of the frame being captured that are certainly
+// in memory. The sample at the DMA write address may still be on its way.
+{
+	if (!dma_channel_is_busy(adc_dma_chan)) return 0;
+	const uint16_t* wa = (const uint16_t*)(uintptr_t)dma_hw->ch[adc_dma_chan].write_addr;
+	return (size_t)(wa - f->samples) - 1;
+}
+
+void __not_in_flash_func(process_samples)(frame_t* f, size_t from, size_t to, stats_acc_t* acc)
+{
+	if (f->corrected) correct_samples(f, from, to);
+	stats_add(acc, f->samples, from, to);
+}
+
+void __not_in_flash_func(core1_main)()
+// Core 1 does nothing but acquire frames, one per ICG period.
+// While a frame is being captured, the samples that have landed are
+// corrected and added into the stats. The next capture is armed as soon
+// as the frame completes, well before the next ICG edge, and only then
+// are the last few samples processed.
+{
+	capture_init(); // so that the DMA IRQ is handled on this core
+	uint32_t seq = 0;
+	frame_t* first = frame_queue_pop(&free_frames);
+	capture_frame = (first) ? first : &spare_frame;
+	apply_timing();
+	timing_changed = false;
+	arm_capture();
+	while (1) {
+		frame_t* f = capture_frame;
+		f->corrected = correction_wanted;
+		f->icg_delay = applied_icg_delay;
+		stats_acc_t acc;
+		stats_begin(&acc);
+		size_t done = 0;
+		while (!capture_done) {
+			size_t landed = samples_landed(f);
+			if (landed > done) {
+				process_samples(f, done, landed, &acc);
+				done = landed;
+			}
+		}
+		f->seq = seq++;
+		// The timer is read as 32 bits by the DMA stamp channel.
+		// The frame started less than 2^32 microseconds ago.
+		uint64_t now = time_us_64();
+		f->start_us64 = now - (uint32_t)((uint32_t)now - f->start_us);
+		f->sh_us = period_sh_us;
+		f->icg_us = period_icg_us;
+		frame_t* next = frame_queue_pop(&free_frames);
+		capture_frame = (next) ? next : &spare_frame;
+		if (timing_changed) {
+			// The ADC is stopped, so this is a safe time.
+			apply_timing();
+			timing_seq = seq;
+			__dmb();
+			timing_changed = false;
+		}
+		arm_capture();
+		if (f == &spare_frame) {
+			// Core 0 is holding every buffer.
+			frames_dropped++;
+			continue;
+		}
+		process_samples(f, done, N_SAMPLES, &acc);
+		stats_finish(f, &acc);
+		frame_queue_push(&ready_frames, f);
+		__sev();
+	}
+}
+
+// For incoming serial comms.
+// Characters from the UART are taken from its FIFO by the UART interrupt and
+// put into a ring buffer, so that nothing is lost while the interpreter is busy,
+// and several commands may be sent without waiting for the responses.
+// The main loop assembles and interprets the lines one at a time.
+// Ctrl-C is not put into the ring buffer but sets abort_requested, which the
+// commands that wait on frames check, so that they can give up early.
+// In the build with the USB data path, characters from USB are moved into
+// the same ring buffer whenever we look for input.
+#define RX_RING_LEN 1024 // power of 2
+#define ABORT_CHAR 0x03
+volatile uint8_t rx_ring[RX_RING_LEN];
+volatile uint32_t rx_head = 0; // count of characters put in by the interrupt
+volatile uint32_t rx_tail = 0; // count of characters taken out
+volatile uint32_t rx_overflows = 0; // characters dropped because the ring was full (see i)
+volatile bool abort_requested = false;
+
+static inline void rx_put(uint8_t c)
+{
+	if (c == ABORT_CHAR) {
+		abort_requested = true;
+		return;
+	}
+	uint32_t h = rx_head;
+	if (h - rx_tail == RX_RING_LEN) {
+		rx_overflows++;
+		return;
+	}
+	rx_ring[h % RX_RING_LEN] = c;
+	rx_head = h + 1;
+}
+
+void uart_rx_irq_handler()
+{
+	uart_hw_t* hw = uart_get_hw(uart0);
+	while (uart_is_readable(uart0)) {
+		rx_put((uint8_t)(hw->dr & 0xff));
+	}
+}
+
+void rx_init()
+// stdio still sends through the UART but no longer reads from it.
+{
+	irq_set_exclusive_handler(UART0_IRQ, uart_rx_irq_handler);
+	irq_set_enabled(UART0_IRQ, true);
+	uart_set_irqs_enabled(uart0, true, false);
+}
+
+void poll_input()
+{
+#if TCD1304_USB_DATA
+	char chars[16];
+	int n;
+	while ((n = stdio_usb.in_chars(chars, sizeof(chars))) > 0) {
+		uint32_t save = save_and_disable_interrupts();
+		for (int k=0; k < n; ++k) { rx_put((uint8_t)chars[k]); }
+		restore_interrupts(save);
+	}
+#endif
+}
+
+bool input_aborted()
+{
+	poll_input();
+	return abort_requested;
+}
+
+int rx_getc()
+// Returns the next character, or -1 if there is none.
+{
+	poll_input();
+	uint32_t t = rx_tail;
+	if (rx_head == t) return -1;
+	int c = rx_ring[t % RX_RING_LEN];
+	rx_tail = t + 1;
+	return c;
+}
+
+#define NBUFA 80
+char bufA[NBUFA];
+int bufA_len = 0;
+
+int poll_getstr(char* buf, int nbuf, int* len)
+// Collect (without echo) whatever characters have arrived into the buffer,
+// without waiting for more, so that the main loop can get on with streaming.
+// *len holds the number of characters collected so far.
+// Returns the length of the line (excluding the terminating null char)
+// when a new-line character is seen, otherwise -1.
+// Only one line is taken at a time, and the rest wait in the ring buffer.
+{
+    int c;
+    while ((c = rx_getc()) >= 0) {
+        if (c != '\n' && c != '\r' && c != '\b' && *len < (nbuf-1)) {
+            // Append a normal character.
+            buf[*len] = (char) c;
+            (*len)++;
+        }
+        if (c == '\n') {
+            int i = *len;
+            buf[i] = '\0';
+            *len = 0;
+            return i;
+        }
+        if (c == '\b' && *len > 0) {
+            // Backspace.
+            (*len)--;
+        }
+    }
+    return -1;
+} // end poll_getstr()
+
+// Frames that started before the most recent period change, or so soon after it
+// that the PIC18 might not yet have applied the new periods, are not reported.
+// The PIC18 may take up to one ICG period (of the old periods) to apply them.
+// The time is kept as 64 bits so that the comparison never wraps.
+volatile uint64_t periods_changed_us = 0;
+volatile uint32_t periods_settle_us = 0;
+
+bool frame_periods_settled(const frame_t* f)
+// True if the frame was exposed with the periods that are recorded in it.
+{
+	uint32_t save = save_and_disable_interrupts(); // the I2C interrupt writes these
+	uint64_t settled_us = periods_changed_us + periods_settle_us;
+	restore_interrupts(save);
+	return f->start_us64 >= settled_us;
+}
+
+void discard_ready_frames()
+{
+	frame_t* f;
+	while ((f = frame_queue_pop(&ready_frames))) {
+		frame_queue_push(&free_frames, f);
+	}
+}
+
+frame_t* wait_for_frame()
+// Returns the next completed frame that was started after the most recent
+// period change had taken effect. The caller owns the frame until it is pushed back
+// onto the free queue.
+// Returns NULL if the wait is aborted (there may be no ICG signal at all).
+{
+	while (1) {
+		frame_t* f = frame_queue_pop(&ready_frames);
+		if (!f) {
+			if (input_aborted()) return NULL;
+			__wfe(); // an interrupt, such as from the UART, also wakes us
+			continue;
+		}
+		if (frame_periods_settled(f)) return f;
+		frame_queue_push(&free_frames, f);
+	}
+}
+
+// Frames that are built by the interpreter (rather than captured by core 1)
+// are held here and never go onto the free queue.
+frame_t coadd_frame;
+uint32_t coadd_sums[N_SAMPLES];
+// Frames are first summed, with the packed kernel, in 16 bits,
+// which holds the sum of up to COADD_BLOCK frames of 12-bit samples.
+#define COADD_BLOCK 16
+uint16_t coadd_block_sums[N_SAMPLES];
+
+void set_report_frame(frame_t* f)
+// The interpreter gives up the frame that it was holding.
+{
+	if (report_frame >= &frames[0] && report_frame < &frames[N_FRAMES]) {
+		frame_queue_push(&free_frames, report_frame);
+	}
+	report_frame = f;
+}
+
+frame_t* take_fresh_frame()
+// Discard frames that are already waiting, then wait for the next frame
+// to complete.
+{
+	discard_ready_frames();
+	frame_t* f = wait_for_frame();
+	if (f) set_report_frame(f);
+	return f;
+}
+
+void coadd_begin(const frame_t* f)
+// Clear the accumulators and take the metadata of coadd_frame from f,
+// the first frame of the sequence.
+{
+	memset(coadd_sums, 0, sizeof(coadd_sums));
+	memset(coadd_block_sums, 0, sizeof(coadd_block_sums));
+	coadd_frame.seq = f->seq;
+	coadd_frame.start_us = f->start_us;
+	coadd_frame.start_us64 = f->start_us64;
+	coadd_frame.sh_us = f->sh_us;
+	coadd_frame.icg_us = f->icg_us;
+	coadd_frame.edge_ctr = f->edge_ctr;
+	coadd_frame.first_ctr = f->first_ctr;
+	coadd_frame.icg_delay = f->icg_delay;
+	coadd_frame.corrected = f->corrected;
+}
+
+int coadd_frames(uint32_t nframes)
+// Sum nframes consecutive frames into 32-bit accumulators and
+// put the per-pixel mean into coadd_frame.
+// Corrected and raw frames have opposite senses, so they are never mixed:
+// if a frame that was captured before the correction was switched on or off
+// turns up, the sum is started again from the first frame with the new setting.
+// Returns the number of frames missed within the sequence (should be 0),
+// or -1 if aborted.
+{
+	discard_ready_frames();
+	frame_t* f = wait_for_frame();
+	if (!f) return -1;
+	coadd_begin(f);
+	uint32_t first_seq = f->seq;
+	uint32_t last_seq = f->seq;
+	for (uint32_t m=0; m < nframes; ++m) {
+		if (m > 0) f = wait_for_frame();
+		if (!f) return -1;
+		if (f->corrected != coadd_frame.corrected) {
+			coadd_begin(f);
+			first_seq = f->seq;
+			m = 0;
+		}
+		dsp_accumulate_u16(coadd_block_sums, f->samples, N_SAMPLES);
+		if ((m + 1) % COADD_BLOCK == 0 || m + 1 == nframes) {
+			for (size_t j=0; j < N_SAMPLES; ++j) {
+				coadd_sums[j] += coadd_block_sums[j];
+			}
+			memset(coadd_block_sums, 0, sizeof(coadd_block_sums));
+		}
+		last_seq = f->seq;
+		coadd_frame.time_taken = (f->start_us + f->time_taken) - coadd_frame.start_us;
+		frame_queue_push(&free_frames, f);
+	}
+	uint32_t half = nframes/2;
+	for (size_t j=0; j < N_SAMPLES; ++j) {
+		coadd_frame.samples[j] = (uint16_t)((coadd_sums[j] + half) / nframes);
+	}
+	frame_stats(&coadd_frame);
+	set_report_frame(&coadd_frame);
+	return (int)(last_seq - first_seq + 1 - nframes);
+}
+
+void pause_correction()
+// Stop core 1 applying the correction, and wait until it has
+// certainly stopped reading the references.
+{
+	correction_wanted = false;
+	discard_ready_frames();
+	while (1) {
+		frame_t* f = wait_for_frame();
+		if (!f) break; // and the command will be aborted
+		bool corrected = f->corrected;
+		frame_queue_push(&free_frames, f);
+		if (!corrected) break;
+	}
+}
+
+void set_unity_gain()
+{
+	for (size_t j=0; j < N_SAMPLES; ++j) { flat_gain[j] = GAIN_ONE; }
+	have_flat_ref = false;
+}
+
+void set_flat_gain(const uint16_t* flat)
+// The gain for each pixel scales its signal in the flat frame to the
+// mean signal of the flat frame. Pixels with no flat signal get unity gain.
+{
+	uint32_t total = 0;
+	for (size_t j=0; j < N_SAMPLES; ++j) {
+		int32_t signal = (int32_t)dark_ref[j] - (int32_t)flat[j];
+		if (signal > 0) total += (uint32_t)signal;
+	}
+	uint32_t mean_signal = total / N_SAMPLES;
+	for (size_t j=0; j < N_SAMPLES; ++j) {
+		int32_t signal = (int32_t)dark_ref[j] - (int32_t)flat[j];
+		uint32_t gain = GAIN_ONE;
+		if (signal > 0) gain = (mean_signal << 14) / (uint32_t)signal;
+		flat_gain[j] = (uint16_t)((gain > 0xffff) ? 0xffff : gain);
+	}
+	have_flat_ref = true;
+}
+
+void set_timing(float clkdiv, uint32_t delay)
+// Returns once core 1 has applied the new timing and
+// every frame that is still waiting was captured with the old timing.
+{
+	adc_clkdiv = clkdiv;
+	icg_delay = delay;
+	__dmb();
+	timing_changed = true;
+	while (timing_changed && !input_aborted()) { tight_loop_contents(); }
+}
+
+frame_t* wait_for_frame_with_timing()
+// The caller owns the returned frame. Returns NULL if aborted.
+{
+	while (1) {
+		frame_t* f = wait_for_frame();
+		if (!f) return NULL;
+		if ((int32_t)(f->seq - timing_seq) >= 0) return f;
+		frame_queue_push(&free_frames, f);
+	}
+}
+
+uint32_t frame_contrast(const frame_t* f)
+// Sum of absolute differences between neighbouring samples.
+// When the samples land on the settled part of each pixel,
+// neighbouring pixels are least blurred together and this is largest.
+{
+	uint32_t total = 0;
+	for (size_t j=1; j < N_SAMPLES; ++j) {
+		total += (uint32_t)abs((int)f->samples[j] - (int)f->samples[j-1]);
+	}
+	return total;
+}
+
+uint32_t max_icg_delay()
+// One pixel period covers every sampling phase, so a longer delay is never needed.
+// Without a limit, a huge delay would hold up the ADC start for many seconds.
+{
+	return clock_get_hz(clk_sys) / PIXEL_RATE_HZ - 1;
+}
+
+uint32_t sweep_phase(uint32_t step, uint32_t* best_contrast)
+// Try each delay across one pixel period and keep the best.
+// If aborted, the original delay is put back.
+{
+	uint32_t pixel_cycles = clock_get_hz(clk_sys) / PIXEL_RATE_HZ;
+	uint32_t original_delay = icg_delay;
+	uint32_t best_delay = 0;
+	*best_contrast = 0;
+	for (uint32_t delay=0; delay < pixel_cycles; delay += step) {
+		set_timing(adc_clkdiv, delay);
+		frame_t* f = wait_for_frame_with_timing();
+		if (!f) {
+			set_timing(adc_clkdiv, original_delay);
+			return original_delay;
+		}
+		uint32_t contrast = frame_contrast(f);
+		frame_queue_push(&free_frames, f);
+		if (contrast > *best_contrast) {
+			*best_contrast = contrast;
+			best_delay = delay;
+		}
+	}
+	set_timing(adc_clkdiv, best_delay);
+	return best_delay;
+}
+
+//   0   1   2   3   4   5   6   7   8   9  10  11  12  13  14  15
+const char base64_alphabet[64] = {
+	'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P',
+	'Q','R','S','T','U','V','W','X','Y','Z','a','b','c','d','e','f',
+	'g','h','i','j','k','l','m','n','o','p','q','r','s','t','u','v',
+	'w','x','y','z','0','1','2','3','4','5','6','7','8','9','+','/'
+};
+
+// Region of interest for reporting, as up to MAX_WINDOWS windows of samples.
+// The frame is always captured in full (the sensor clocks out every pixel
+// in each ICG period anyway) but only the samples within the windows are
+// gathered into report_samples and transferred.
+#define MAX_WINDOWS 4
+typedef struct {
+	uint16_t start;
+	uint16_t len;
+} window_t;
+window_t roi[MAX_WINDOWS] = {{0, N_SAMPLES}};
+uint8_t n_roi = 1;
+uint16_t report_samples[N_SAMPLES];
+
+// Adjacent samples may be binned (summed or averaged) within each window.
+// A partial bin at the end of a window is not reported.
+// Sums of up to 16 12-bit samples need as many as 16 bits.
+uint8_t bin_shift = 0; // factor is 1 << bin_shift
+bool bin_sum = false;  // otherwise, the rounded average is reported
+
+size_t report_length()
+{
+	size_t n = 0;
+	for (uint8_t w=0; w < n_roi; ++w) { n += roi[w].len >> bin_shift; }
+	return n;
+}
+
+bool report_is_wide()
+// Reported values may not fit in 12 bits.
+{
+	return bin_sum && bin_shift > 0;
+}
+
+size_t gather_report_samples(const frame_t* f)
+// Returns the number of (binned) samples gathered.
+{
+	size_t n = 0;
+	for (uint8_t w=0; w < n_roi; ++w) {
+		const uint16_t* src = &f->samples[roi[w].start];
+		if (bin_shift == 0) {
+			memcpy(&report_samples[n], src, roi[w].len*sizeof(uint16_t));
+			n += roi[w].len;
+			continue;
+		}
+		size_t nbins = roi[w].len >> bin_shift;
+		uint16_t* dst = &report_samples[n];
+		dsp_bin_sum_u16(dst, src, nbins, 1u << bin_shift);
+		if (!bin_sum) {
+			uint32_t half = (1u << bin_shift)/2;
+			for (size_t b=0; b < nbins; ++b) {
+				dst[b] = (uint16_t)((dst[b] + half) >> bin_shift);
+			}
+		}
+		n += nbins;
+	}
+	return n;
+}
+
+// Binary reports are sent as packets, each framed with COBS
+// (Consistent Overhead Byte Stuffing) so that a zero byte only ever appears
+// as the delimiter before and after a packet. A receiver that loses
+// bytes can resynchronize at the next zero byte.
+// Before encoding, a packet is a header, a payload and a CRC-32 (as for zlib)
+// of the header and payload. Multi-byte fields are little-endian.
+//   byte 0    format of the payload (one of the PKT_FORMAT values)
+//   byte 1    length of the header, in bytes
+//   bytes 2-3 number of values in the payload
+//   bytes 4-7 frame sequence number
+//   bytes 8-15  time of the ICG edge that started the frame, microseconds since boot
+//   bytes 16-19 capture duration, microseconds from the ICG edge to the last sample
+//   bytes 20-21 SH period, microseconds
+//   bytes 22-23 ICG period, microseconds
+//   bytes 24-27 number of frames lost (dropped on the Pico2) since the previous report
+// A receiver should use the header length to find the payload,
+// so that fields may be added to the end of the header.
+#define PKT_FORMAT_PACKED12 1 // two 12-bit values in 3 bytes
+#define PKT_FORMAT_U16 2      // one 16-bit value in 2 bytes (for summed bins)
+#define PKT_FORMAT_RICE 3     // Rice-coded differences (see rice_encode)
+#define PKT_FORMAT_SPARSE 4   // runs of changed values (see report_sparse)
+#define PKT_HEADER_LEN 28
+#define PKT_MAX (PKT_HEADER_LEN + 3*N_SAMPLES + 4)
+uint8_t packet_buf[PKT_MAX];
+uint32_t crc32_table[256];
+
+void crc32_init()
+{
+	for (uint32_t n=0; n < 256; ++n) {
+		uint32_t c = n;
+		for (int k=0; k < 8; ++k) {
+			c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+		}
+		crc32_table[n] = c;
+	}
+}
+
+uint32_t crc32(const uint8_t* buf, size_t len)
+{
+	uint32_t c = 0xffffffffu;
+	for (size_t j=0; j < len; ++j) {
+		c = crc32_table[(c ^ buf[j]) & 0xff] ^ (c >> 8);
+	}
+	return c ^ 0xffffffffu;
+}
+
+size_t cobs_encode(const uint8_t* src, size_t len, uint8_t* dst)
+// Returns the number of bytes written to dst, not including any delimiter.
+{
+	size_t code_pos = 0;
+	size_t out = 1;
+	uint8_t code = 1;
+	for (size_t j=0; j < len; ++j) {
+		if (src[j] == 0) {
+			dst[code_pos] = code;
+			code_pos = out++;
+			code = 1;
+		} else {
+			dst[out++] = src[j];
+			code++;
+			if (code == 0xff) {
+				dst[code_pos] = code;
+				code_pos = out++;
+				code = 1;
+			}
+		}
+	}
+	dst[code_pos] = code;
+	return out;
+}
+
+// Frame data may be sent on just one of the stdio drivers,
+// while the command responses go to all of them.
+// 0: all drivers, 1: USB only, 2: UART only.
+// Without the USB data path in the build, there is only the UART.
+uint8_t data_output = 0;
+
+void begin_data_output()
+{
+#if TCD1304_USB_DATA
+	if (data_output == 1) stdio_filter_driver(&stdio_usb);
+	if (data_output == 2) stdio_filter_driver(&stdio_uart);
+#endif
+}
+
+void end_data_output()
+{
+#if TCD1304_USB_DATA
+	stdio_flush();
+	stdio_filter_driver(NULL);
+#endif
+}
+
+// Reports are built in one of a pair of transmit buffers and then sent as a block.
+// When the UART is the only destination, a DMA channel paced by the UART TX DREQ
+// feeds it, so the CPU is free as soon as the report has been built, and the
+// next report can be built in the other buffer while this one is being sent.
+// Anything else that writes to stdio must first call tx_wait().
+// The largest report is the decimal (r) report.
+#if PICO_STDIO_DEFAULT_CRLF
+#define EOL "\r\n"
+#else
+#define EOL "\n"
+#endif
+#define TX_BUF_LEN (N_SAMPLES*(5 + sizeof(EOL) - 1) + 96) // up to 5 digits for summed bins, and a header line
+uint8_t tx_bufs[2][TX_BUF_LEN] __attribute__((aligned(4)));
+uint8_t tx_next = 0; // index of the buffer to fill next
+int tx_dma_chan;
+dma_channel_config tx_dma_cfg;
+
+void tx_init()
+{
+	tx_dma_chan = dma_claim_unused_channel(true);
+	tx_dma_cfg = dma_channel_get_default_config(tx_dma_chan);
+	channel_config_set_transfer_data_size(&tx_dma_cfg, DMA_SIZE_8);
+	channel_config_set_read_increment(&tx_dma_cfg, true);
+	channel_config_set_write_increment(&tx_dma_cfg, false);
+	channel_config_set_dreq(&tx_dma_cfg, DREQ_UART0_TX);
+}
+
+bool tx_uses_dma()
+{
+#if TCD1304_USB_DATA
+	return data_output == 2;
+#else
+	return true;
+#endif
+}
+
+void tx_wait()
+// Block until the DMA channel has handed the last byte to the UART.
+{
+	dma_channel_wait_for_finish_blocking(tx_dma_chan);
+}
+
+uint8_t* tx_begin()
+// Returns the buffer to fill. Any transfer in progress is from the other buffer.
+{
+	return tx_bufs[tx_next];
+}
+
+void tx_send(size_t len)
+// Sends the first len bytes of the buffer from tx_begin(), as raw bytes,
+// without any new-line translation.
+{
+	uint8_t* buf = tx_bufs[tx_next];
+	tx_next ^= 1;
+	if (!tx_uses_dma()) {
+		stdio_put_string((const char*)buf, (int)len, false, false);
+		return;
+	}
+	tx_wait();
+	dma_channel_configure(tx_dma_chan, &tx_dma_cfg, &uart_get_hw(uart0)->dr, buf, len, true);
+}
+
+static inline size_t put_eol(char* dst)
+{
+	memcpy(dst, EOL, sizeof(EOL)-1);
+	return sizeof(EOL)-1;
+}
+
+// Frames lost since the previous report, counted when the report is started.
+// Core 1 drops a frame when it has no free buffer, and core 0 drops
+// frames from its streaming queue when that is full.
+uint32_t stream_drops = 0; // by core 0, ever
+uint32_t lost_at_last_report = 0;
+uint32_t report_lost = 0;
+
+static inline void put_le(uint8_t* dst, uint64_t value, int nbytes)
+{
+	for (int k=0; k < nbytes; ++k) { dst[k] = (uint8_t)(value >> (8*k)); }
+}
+
+size_t begin_packet(uint8_t format, size_t nvalues, const frame_t* f)
+// Writes the header into packet_buf and returns the offset of the payload.
+{
+	packet_buf[0] = format;
+	packet_buf[1] = PKT_HEADER_LEN;
+	put_le(&packet_buf[2], nvalues, 2);
+	put_le(&packet_buf[4], f->seq, 4);
+	put_le(&packet_buf[8], f->start_us64, 8);
+	put_le(&packet_buf[16], f->time_taken, 4);
+	put_le(&packet_buf[20], f->sh_us, 2);
+	put_le(&packet_buf[22], f->icg_us, 2);
+	put_le(&packet_buf[24], report_lost, 4);
+	return PKT_HEADER_LEN;
+}
+
+void send_packet(size_t len)
+// Appends the CRC to the len bytes in packet_buf, then encodes and sends.
+{
+	uint32_t crc = crc32(packet_buf, len);
+	for (int k=0; k < 4; ++k) { packet_buf[len++] = (uint8_t)(crc >> (8*k)); }
+	uint8_t* buf = tx_begin();
+	buf[0] = 0;
+	size_t n = 1 + cobs_encode(packet_buf, len, &buf[1]);
+	buf[n++] = 0;
+	tx_send(n);
+}
+
+size_t pack12(const uint16_t* values, size_t n, uint8_t* dst)
+// Two 12-bit values a, b go into 3 bytes:
+//   a[7:0], b[3:0]a[11:8], b[11:4]
+// An odd value at the end goes into 2 bytes. Returns the number of bytes.
+{
+	size_t out = 0;
+	size_t j = 0;
+	for (; j+1 < n; j += 2) {
+		uint16_t a = values[j] & 0x0fff;
+		uint16_t b = values[j+1] & 0x0fff;
+		dst[out++] = (uint8_t)(a & 0xff);
+		dst[out++] = (uint8_t)((a >> 8) | ((b & 0x0f) << 4));
+		dst[out++] = (uint8_t)(b >> 4);
+	}
+	if (j < n) {
+		dst[out++] = (uint8_t)(values[j] & 0xff);
+		dst[out++] = (uint8_t)((values[j] >> 8) & 0x0f);
+	}
+	return out;
+}
+
+size_t put_values(const uint16_t* values, size_t n, uint8_t* dst)
+// Packed 12-bit values or, if they may be wider, 16-bit values.
+// Returns the number of bytes.
+{
+	if (!report_is_wide()) return pack12(values, n, dst);
+	for (size_t j=0; j < n; ++j) {
+		dst[2*j] = (uint8_t)(values[j] & 0xff);
+		dst[2*j+1] = (uint8_t)(values[j] >> 8);
+	}
+	return 2*n;
+}
+
+void send_values_packet(const frame_t* f, size_t n)
+// The n report samples, already gathered.
+{
+	uint8_t format = (report_is_wide()) ? PKT_FORMAT_U16 : PKT_FORMAT_PACKED12;
+	size_t len = begin_packet(format, n, f);
+	len += put_values(report_samples, n, &packet_buf[len]);
+	send_packet(len);
+}
+
+void report_packed(const frame_t* f)
+{
+	size_t n = gather_report_samples(f);
+	send_values_packet(f, n);
+}
+
+// Lossless compression of the report samples.
+// Neighbouring samples differ by small amounts (apart from spectral lines),
+// so each sample is predicted by the previous one and the difference is
+// mapped to an unsigned value u (0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...)
+// and Rice coded.
+// The payload starts with the first sample as a 16-bit value, followed by
+// a bit stream (most-significant bit first, zero-padded to a whole byte).
+// The values are coded in blocks of RICE_BLOCK, each starting with its own
+// parameter k in 5 bits, so that the coding adapts along the frame.
+// Each u is coded as q = u >> k in unary (q 1-bits then a 0-bit), then
+// the low k bits of u. If q would be RICE_QMAX or more, RICE_QMAX 1-bits
+// are followed by u in RICE_ESCAPE_BITS bits instead.
+#define RICE_BLOCK 32
+#define RICE_QMAX 20
+#define RICE_ESCAPE_BITS 18
+#define RICE_KMAX 17
+
+typedef struct {
+	uint8_t* buf;
+	size_t pos;
+	size_t capacity;
+	uint32_t acc;
+	int nbits;
+} bit_writer_t;
+
+static inline void put_bits(bit_writer_t* w, uint32_t value, int n)
+// n must be no more than 24.
+{
+	w->acc = (w->acc << n) | (value & ((1u << n) - 1));
+	w->nbits += n;
+	while (w->nbits >= 8) {
+		w->nbits -= 8;
+		if (w->pos < w->capacity) w->buf[w->pos] = (uint8_t)(w->acc >> w->nbits);
+		w->pos++;
+	}
+}
+
+static inline uint32_t zigzag(int32_t r)
+{
+	return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+uint32_t rice_cost(const uint32_t* u, size_t n, int k)
+// Number of bits to code the n values with parameter k.
+{
+	uint32_t bits = 0;
+	for (size_t j=0; j < n; ++j) {
+		uint32_t q = u[j] >> k;
+		bits += (q < RICE_QMAX) ? q + 1 + k : RICE_QMAX + RICE_ESCAPE_BITS;
+	}
+	return bits;
+}
+
+size_t rice_encode(const uint16_t* values, size_t n, uint8_t* dst, size_t capacity)
+// Returns the number of bytes written, or 0 if they would not fit.
+{
+	if (n == 0 || capacity < 2) return 0;
+	dst[0] = (uint8_t)(values[0] & 0xff);
+	dst[1] = (uint8_t)(values[0] >> 8);
+	bit_writer_t w = {dst, 2, capacity, 0, 0};
+	uint32_t u[RICE_BLOCK];
+	for (size_t j0=1; j0 < n; j0 += RICE_BLOCK) {
+		size_t nb = (n - j0 < RICE_BLOCK) ? n - j0 : RICE_BLOCK;
+		uint32_t total = 0;
+		for (size_t j=0; j < nb; ++j) {
+			u[j] = zigzag((int32_t)values[j0+j] - (int32_t)values[j0+j-1]);
+			total += u[j];
+		}
+		// Start from the k that suits the mean value, then try its neighbours.
+		int k = 0;
+		while (k < RICE_KMAX && ((uint32_t)nb << (k+1)) <= total) { k++; }
+		int best_k = k;
+		uint32_t best_cost = rice_cost(u, nb, k);
+		for (int kk = k-1; kk <= k+1; kk += 2) {
+			if (kk < 0 || kk > RICE_KMAX) continue;
+			uint32_t cost = rice_cost(u, nb, kk);
+			if (cost < best_cost) { best_cost = cost; best_k = kk; }
+		}
+		put_bits(&w, (uint32_t)best_k, 5);
+		for (size_t j=0; j < nb; ++j) {
+			uint32_t q = u[j] >> best_k;
+			if (q < RICE_QMAX) {
+				put_bits(&w, ((1u << q) - 1) << 1, (int)q + 1);
+				if (best_k > 0) put_bits(&w, u[j], best_k);
+			} else {
+				put_bits(&w, (1u << RICE_QMAX) - 1, RICE_QMAX);
+				put_bits(&w, u[j], RICE_ESCAPE_BITS);
+			}
+		}
+		if (w.pos > capacity) return 0;
+	}
+	if (w.nbits > 0) put_bits(&w, 0, 8 - w.nbits);
+	return (w.pos > capacity) ? 0 : w.pos;
+}
+
+void report_rice(const frame_t* f)
+// If the coded values would be larger than the packed values,
+// the packed report is sent instead.
+{
+	size_t n = gather_report_samples(f);
+	size_t len = begin_packet(PKT_FORMAT_RICE, n, f);
+	size_t limit = (report_is_wide()) ? 2*n : (3*n + 1)/2;
+	size_t nbytes = rice_encode(report_samples, n, &packet_buf[len], limit);
+	if (nbytes == 0) {
+		send_values_packet(f, n);
+		return;
+	}
+	send_packet(len + nbytes);
+}
+
+// Sparse updates, for when most of the frame is static.
+// The Pico2 keeps a copy of the values as the PC should have them.
+// A full (keyframe) packet is sent to start, every sparse_key_interval
+// reports and whenever an update would be larger than a keyframe.
+// Otherwise, the update packet has only the values that have changed
+// by more than sparse_threshold since they were last sent.
+// The payload of an update is:
+//   bytes 0-3  sequence number of the frame last reported (the reference)
+//   bytes 4-5  number of runs
+// then, for each run of neighbouring values,
+//   2 bytes for the index of the first value, 2 bytes for the number of values,
+//   then the values, packed as for a keyframe.
+// Short gaps between changed values are included in a run, since
+// that costs fewer bytes than starting a new run.
+// The PC should ask for a keyframe (with the U command) if it misses a packet.
+#define SPARSE_MAX_GAP 2
+uint16_t sparse_sent[N_SAMPLES];
+size_t sparse_sent_n = 0; // zero when the PC has no reference frame
+uint32_t sparse_sent_seq = 0;
+uint32_t sparse_key_interval = 50;
+uint16_t sparse_threshold = 8;
+uint32_t sparse_since_key = 0;
+
+static inline bool sparse_changed(size_t j)
+{
+	return abs((int)report_samples[j] - (int)sparse_sent[j]) > sparse_threshold;
+}
+
+void report_sparse(const frame_t* f)
+{
+	size_t n = gather_report_samples(f);
+	bool key = (n != sparse_sent_n) || (sparse_since_key + 1 >= sparse_key_interval);
+	if (!key) {
+		size_t limit = PKT_HEADER_LEN + ((report_is_wide()) ? 2*n : (3*n + 1)/2);
+		size_t len = begin_packet(PKT_FORMAT_SPARSE, n, f);
+		for (int k=0; k < 4; ++k) { packet_buf[len++] = (uint8_t)(sparse_sent_seq >> (8*k)); }
+		size_t nruns_pos = len;
+		len += 2;
+		uint16_t nruns = 0;
+		size_t j = 0;
+		while (j < n && !key) {
+			if (!sparse_changed(j)) { j++; continue; }
+			size_t start = j;
+			size_t end = j + 1;
+			for (size_t k = j + 1; k < n && k - end <= SPARSE_MAX_GAP; ++k) {
+				if (sparse_changed(k)) end = k + 1;
+			}
+			size_t count = end - start;
+			// Worst case for this run is its 4-byte prefix and 2 bytes per value.
+			if (len + 4 + 2*count > limit) {
+				key = true;
+				break;
+			}
+			packet_buf[len++] = (uint8_t)(start & 0xff);
+			packet_buf[len++] = (uint8_t)(start >> 8);
+			packet_buf[len++] = (uint8_t)(count & 0xff);
+			packet_buf[len++] = (uint8_t)(count >> 8);
+			len += put_values(&report_samples[start], count, &packet_buf[len]);
+			memcpy(&sparse_sent[start], &report_samples[start], count*sizeof(uint16_t));
+			nruns++;
+			j = end;
+		}
+		if (!key) {
+			packet_buf[nruns_pos] = (uint8_t)(nruns & 0xff);
+			packet_buf[nruns_pos+1] = (uint8_t)(nruns >> 8);
+			send_packet(len);
+			sparse_since_key++;
+		}
+	}
+	if (key) {
+		// Some of sparse_sent may have been updated already, but
+		// all of it is replaced here.
+		send_values_packet(f, n);
+		memcpy(sparse_sent, report_samples, n*sizeof(uint16_t));
+		sparse_sent_n = n;
+		sparse_since_key = 0;
+	}
+	sparse_sent_seq = f->seq;
+}
+
+size_t encode_decimal_report_simple(const uint16_t* values, size_t n, char* dst)
+// One decimal value per line. Returns the number of characters.
+// This is the straight-forward version, kept as the reference for the benchmark.
+{
+	char* p = dst;
+	for (size_t j=0; j < n; ++j) {
+		char digits[5];
+		int nd = 0;
+		uint16_t v = values[j];
+		do { digits[nd++] = (char)('0' + v % 10); v /= 10; } while (v);
+		while (nd) { *p++ = digits[--nd]; }
+		p += put_eol(p);
+	}
+	return (size_t)(p - dst);
+}
+
+// The two decimal digits for each of 0 to 99.
+const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+size_t __not_in_flash_func(encode_decimal_report)(const uint16_t* values, size_t n, char* dst)
+// The same output as encode_decimal_report_simple, two digits at a time,
+// with the division by 100 done as a multiplication by the compiler.
+{
+	char* p = dst;
+	for (size_t j=0; j < n; ++j) {
+		uint32_t v = values[j];
+		if (v >= 10000) {
+			// Only summed bins get this large.
+			uint32_t top = v / 10000;
+			v -= top * 10000;
+			*p++ = (char)('0' + top);
+			uint32_t hi = v / 100;
+			memcpy(p, &digit_pairs[2*hi], 2);
+			memcpy(p+2, &digit_pairs[2*(v - hi*100)], 2);
+			p += 4;
+		} else if (v >= 100) {
+			uint32_t hi = v / 100;
+			uint32_t lo = v - hi*100;
+			if (hi >= 10) {
+				memcpy(p, &digit_pairs[2*hi], 2);
+				p += 2;
+			} else {
+				*p++ = (char)('0' + hi);
+			}
+			memcpy(p, &digit_pairs[2*lo], 2);
+			p += 2;
+		} else if (v >= 10) {
+			memcpy(p, &digit_pairs[2*v], 2);
+			p += 2;
+		} else {
+			*p++ = (char)('0' + v);
+		}
+		p += put_eol(p);
+	}
+	return (size_t)(p - dst);
+}
+
+size_t encode_base64_report_simple(const uint16_t* values, size_t n, bool wide, char* dst)
+// Two (or, if wide, three) base64 characters per value and 20 values per line.
+// Returns the number of characters.
+// This is the straight-forward version, kept as the reference for the benchmark.
+{
+	char* p = dst;
+	for (size_t j=0; j < n; ++j) {
+		uint16_t val = values[j];
+		if (wide) *p++ = base64_alphabet[val >> 12];
+		*p++ = base64_alphabet[(val & 0x0FFF) >> 6];
+		*p++ = base64_alphabet[val & 0x003F];
+		if ((j % 20) == 19 || j == n-1) p += put_eol(p);
+	}
+	return (size_t)(p - dst);
+}
+
+// The pair of base64 characters for every 12-bit value, built by the compiler.
+// Each entry holds the first character in its low byte so that, on our
+// little-endian cores, it can be stored to the output as a single halfword.
+// It is not const, so that it lives in RAM rather than in (cached) flash.
+#define B64_CHAR(i) ((i) < 26 ? 'A' + (i) : (i) < 52 ? 'a' + (i) - 26 : \
+                     (i) < 62 ? '0' + (i) - 52 : (i) == 62 ? '+' : '/')
+#define B64_PAIR(v) ((uint16_t)(B64_CHAR((v) >> 6) | (B64_CHAR((v) & 63) << 8)))
+#define B64_R4(v) B64_PAIR(v), B64_PAIR((v)+1), B64_PAIR((v)+2), B64_PAIR((v)+3)
+#define B64_R16(v) B64_R4(v), B64_R4((v)+4), B64_R4((v)+8), B64_R4((v)+12)
+#define B64_R64(v) B64_R16(v), B64_R16((v)+16), B64_R16((v)+32), B64_R16((v)+48)
+#define B64_R256(v) B64_R64(v), B64_R64((v)+64), B64_R64((v)+128), B64_R64((v)+192)
+#define B64_R1024(v) B64_R256(v), B64_R256((v)+256), B64_R256((v)+512), B64_R256((v)+768)
+uint16_t base64_pairs[4096] = {
+	B64_R1024(0), B64_R1024(1024), B64_R1024(2048), B64_R1024(3072)
+};
+
+size_t __not_in_flash_func(encode_base64_report)(const uint16_t* values, size_t n, bool wide, char* dst)
+// The same output as encode_base64_report_simple, in one pass with one
+// table lookup and one store per value, a line at a time.
+{
+	char* p = dst;
+	size_t j = 0;
+	while (j < n) {
+		size_t m = (n - j < 20) ? n - j : 20;
+		const uint16_t* v = &values[j];
+		if (wide) {
+			for (size_t k=0; k < m; ++k) {
+				*p++ = base64_alphabet[v[k] >> 12];
+				memcpy(p, &base64_pairs[v[k] & 0x0fff], 2);
+				p += 2;
+			}
+		} else {
+			for (size_t k=0; k < m; ++k) {
+				memcpy(p, &base64_pairs[v[k] & 0x0fff], 2);
+				p += 2;
+			}
+		}
+		j += m;
+		p += put_eol(p);
+	}
+	return (size_t)(p - dst);
+}
+
+// Peak detection, for the positions and intensities of spectral lines.
+// The signal is the light level: the corrected sample or, for a raw frame,
+// 4095 less the sample, since the TCD1304 output falls with exposure.
+// A peak is a local maximum of the signal that is at least peak_threshold and
+// that stands at least peak_prominence above its base, which is the higher of
+// the lowest signals on either side, before a higher signal or PEAK_SEARCH samples.
+// The position is refined to a fraction of a pixel with a parabola through the
+// three samples at the top (p) or as the centroid of the signal above the base,
+// within PEAK_CENTROID_HALF samples of the top (c).
+// If there are more than MAX_PEAKS, the most prominent are kept.
+#define MAX_PEAKS 32
+#define PEAK_SEARCH 64
+#define PEAK_CENTROID_HALF 4
+typedef struct {
+	float position; // sample index
+	float height;   // signal at the top
+	uint16_t prominence;
+} peak_t;
+peak_t peaks[MAX_PEAKS];
+uint16_t peak_threshold = 200;
+uint16_t peak_prominence = 100;
+bool peak_centroid = false;
+
+static inline int32_t peak_signal(const frame_t* f, size_t j)
+{
+	return (f->corrected) ? (int32_t)f->samples[j] : 4095 - (int32_t)f->samples[j];
+}
+
+void refine_peak(const frame_t* f, size_t j, int32_t base, peak_t* p)
+{
+	int32_t top = peak_signal(f, j);
+	p->position = (float)j;
+	p->height = (float)top;
+	if (peak_centroid) {
+		size_t k0 = (j > PEAK_CENTROID_HALF) ? j - PEAK_CENTROID_HALF : 0;
+		size_t k1 = (j + PEAK_CENTROID_HALF < N_SAMPLES) ? j + PEAK_CENTROID_HALF : N_SAMPLES-1;
+		int32_t total = 0;
+		int32_t moment = 0; // relative to k0
+		for (size_t k=k0; k <= k1; ++k) {
+			int32_t w = peak_signal(f, k) - base;
+			if (w <= 0) continue;
+			total += w;
+			moment += w * (int32_t)(k - k0);
+		}
+		if (total > 0) p->position = (float)k0 + (float)moment / (float)total;
+		return;
+	}
+	int32_t a = peak_signal(f, j-1);
+	int32_t c = peak_signal(f, j+1);
+	int32_t denom = a - 2*top + c;
+	if (denom == 0) return;
+	float delta = 0.5f * (float)(a - c) / (float)denom;
+	p->position += delta;
+	p->height -= 0.25f * (float)(a - c) * delta;
+}
+
+size_t find_peaks(const frame_t* f)
+// Returns the number of peaks found, in order of position.
+{
+	size_t npeaks = 0;
+	for (size_t j=1; j+1 < N_SAMPLES; ++j) {
+		int32_t top = peak_signal(f, j);
+		if (top < peak_threshold) continue;
+		if (top <= peak_signal(f, j-1) || top < peak_signal(f, j+1)) continue;
+		int32_t left_min = top;
+		for (size_t k=j; k > 0 && j - k < PEAK_SEARCH; --k) {
+			int32_t v = peak_signal(f, k-1);
+			if (v > top) break;
+			if (v < left_min) left_min = v;
+		}
+		int32_t right_min = top;
+		for (size_t k=j+1; k < N_SAMPLES && k - j <= PEAK_SEARCH; ++k) {
+			int32_t v = peak_signal(f, k);
+			if (v > top) break;
+			if (v < right_min) right_min = v;
+		}
+		int32_t base = (left_min > right_min) ? left_min : right_min;
+		if (top - base < peak_prominence) continue;
+		size_t slot = npeaks;
+		if (npeaks == MAX_PEAKS) {
+			// Replace the least prominent, if this one stands higher.
+			slot = 0;
+			for (size_t m=1; m < MAX_PEAKS; ++m) {
+				if (peaks[m].prominence < peaks[slot].prominence) slot = m;
+			}
+			if (peaks[slot].prominence >= top - base) continue;
+			memmove(&peaks[slot], &peaks[slot+1], (MAX_PEAKS-1-slot)*sizeof(peak_t));
+			slot = MAX_PEAKS-1;
+		} else {
+			npeaks++;
+		}
+		peaks[slot].prominence = (uint16_t)(top - base);
+		refine_peak(f, j, base, &peaks[slot]);
+	}
+	return npeaks;
+}
 
-// We want to capture a batch of samples.
-const uint ADC_PIN = 26;
-#define N_SAMPLES 3800
-uint16_t adc_samples[N_SAMPLES];
+// Histogram of the light signal (as for peak detection) over the whole frame,
+// one bin per ADC count, so that the percentiles are exact.
+// Samples with a signal at or above sat_level are counted as saturated
+// (or clipped by the ADC) and those at or below dark_level as dark.
+// Percentiles are nearest-rank values.
+#define MAX_PERCENTILES 8
+uint16_t signal_histogram[4096];
+uint16_t sat_level = 4000;
+uint16_t dark_level = 50;
+float percentiles[MAX_PERCENTILES] = {1.0f, 5.0f, 50.0f, 95.0f, 99.0f};
+uint8_t n_percentiles = 5;
 
-void __not_in_flash_func(adc_capture)(uint16_t *buf, size_t count)
+void build_histogram(const frame_t* f)
 {
-	adc_run(true);
-	for (size_t i=0; i < count; i++) {
-		buf[i] = adc_fifo_get_blocking();
+	memset(signal_histogram, 0, sizeof(signal_histogram));
+	for (size_t j=0; j < N_SAMPLES; ++j) {
+		int32_t v = peak_signal(f, j);
+		signal_histogram[(v < 0) ? 0 : (v > 4095) ? 4095 : v]++;
 	}
-	adc_run(false);
-	adc_fifo_drain();
-	return;
 }
 
-// For incoming serial comms
-#define NBUFA 80
-char bufA[NBUFA];
+uint16_t histogram_percentile(float pct)
+{
+	uint32_t rank = (uint32_t)ceilf(pct * N_SAMPLES / 100.0f);
+	if (rank < 1) rank = 1;
+	uint32_t count = 0;
+	for (uint16_t v=0; v < 4096; ++v) {
+		count += signal_histogram[v];
+		if (count >= rank) return v;
+	}
+	return 4095;
+}
 
-int getstr(char* buf, int nbuf)
-// Read (without echo) a line of characters into the buffer,
-// stopping when we see a new-line character.
-// Returns the number of characters collected,
-// excluding the terminating null char.
-{
-    int i = 0;
-    char c;
-    uint8_t done = 0;
-    while (!done) {
-        c = getc(stdin);
-        if (c != '\n' && c != '\r' && c != '\b' && i < (nbuf-1)) {
-            // Append a normal character.
-            buf[i] = c;
-            i++;
-        }
-        if (c == '\n') {
-            done = 1;
-            buf[i] = '\0';
-        }
-        if (c == '\b' && i > 0) {
-            // Backspace.
-            i--;
-        }
-    }
-    return i;
-} // end getstr()
+void report_histogram(const frame_t* f)
+// g min max nsat ndark, then the value at each percentile.
+{
+	build_histogram(f);
+	uint16_t min = 0;
+	while (min < 4095 && signal_histogram[min] == 0) { min++; }
+	uint16_t max = 4095;
+	while (max > 0 && signal_histogram[max] == 0) { max--; }
+	uint32_t nsat = 0;
+	for (uint32_t v=sat_level; v < 4096; ++v) { nsat += signal_histogram[v]; }
+	uint32_t ndark = 0;
+	for (uint32_t v=0; v <= dark_level && v < 4096; ++v) { ndark += signal_histogram[v]; }
+	printf("g %u %u %u %u", min, max, nsat, ndark);
+	for (uint8_t m=0; m < n_percentiles; ++m) {
+		printf(" %u", histogram_percentile(percentiles[m]));
+	}
+	printf("\n");
+}
 
-//   0   1   2   3   4   5   6   7   8   9  10  11  12  13  14  15
-const char base64_alphabet[64] = {
-	'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P',
-	'Q','R','S','T','U','V','W','X','Y','Z','a','b','c','d','e','f',
-	'g','h','i','j','k','l','m','n','o','p','q','r','s','t','u','v',
-	'w','x','y','z','0','1','2','3','4','5','6','7','8','9','+','/'
-};
+size_t encode_peak_report(const frame_t* f, size_t npeaks, char* dst)
+// e seq npeaks, then position, height and prominence for each peak.
+{
+	int len = sprintf(dst, "e %u %u", f->seq, npeaks);
+	for (size_t m=0; m < npeaks; ++m) {
+		len += sprintf(&dst[len], " %.2f %.1f %u", peaks[m].position, peaks[m].height,
+					   peaks[m].prominence);
+	}
+	return (size_t)len + put_eol(&dst[len]);
+}
+
+bool report_format_ok(char fmt)
+{
+	return fmt != '\0' && strchr("rqQzue", fmt) != NULL;
+}
+
+// The text reports (r, q and e) may start with a line of metadata:
+//   h seq start_us64 time_taken sh_us icg_us lost
+// with the same values as in the header of a binary packet.
+bool text_header = false;
+
+size_t put_text_header(const frame_t* f, char* dst)
+{
+	int len = sprintf(dst, "h %u %llu %u %u %u %u", f->seq, (unsigned long long)f->start_us64,
+					  f->time_taken, f->sh_us, f->icg_us, report_lost);
+	return (size_t)len + put_eol(&dst[len]);
+}
+
+void send_report(char fmt, const frame_t* f)
+// Report the frame in the format of the r, q, Q, z, u or e command.
+{
+	uint32_t lost = frames_dropped + stream_drops;
+	report_lost = lost - lost_at_last_report;
+	lost_at_last_report = lost;
+	begin_data_output();
+	switch (fmt) {
+	case 'r': {
+		size_t n = gather_report_samples(f);
+		char* buf = (char*)tx_begin();
+		size_t len = (text_header) ? put_text_header(f, buf) : 0;
+		tx_send(len + encode_decimal_report(report_samples, n, &buf[len]));
+		} break;
+	case 'q': {
+		size_t n = gather_report_samples(f);
+		char* buf = (char*)tx_begin();
+		size_t len = (text_header) ? put_text_header(f, buf) : 0;
+		tx_send(len + encode_base64_report(report_samples, n, report_is_wide(), &buf[len]));
+		} break;
+	case 'Q': report_packed(f); break;
+	case 'z': report_rice(f); break;
+	case 'u': report_sparse(f); break;
+	case 'e': {
+		size_t npeaks = find_peaks(f);
+		char* buf = (char*)tx_begin();
+		size_t len = (text_header) ? put_text_header(f, buf) : 0;
+		tx_send(len + encode_peak_report(f, npeaks, &buf[len]));
+		} break;
+	}
+	end_data_output();
+}
+
+// The link to the PIC18 on the driver board is driven by interrupts,
+// so that a period change does not hold up the interpreter or a stream.
+// The whole message (with a STOP after the last byte) fits into the TX FIFO
+// of the I2C block and is loaded at once. The I2C interrupt then reports
+// either the STOP (the message was sent) or an abort (for example, no ACK
+// from the PIC18), and the new periods take effect, for the frame filters
+// and the metadata, when the message has been sent.
+// The main loop reports the result of a p command and gives up on a
+// message that has not finished within I2C_TIMEOUT_US.
+#define PIC18_I2C_ADDR 0x51
+#define I2C_TIMEOUT_US 20000
+#define PERIODS_BY_COMMAND 1
+#define PERIODS_BY_AE 2
+volatile uint8_t i2c_busy = 0;   // who started the message in flight, or 0
+volatile uint8_t i2c_result = 0; // who started the message that has just finished
+volatile bool i2c_ok = false;
+uint32_t i2c_started_us = 0;
+bool i2c_aborting = false;
+uint16_t i2c_sh_us;  // the periods in the message
+uint16_t i2c_icg_us;
+uint32_t i2c_baud = 100*1000;
+uint32_t ae_changes = 0; // SH periods set by automatic exposure
+
+void i2c_finish(bool ok)
+{
+	if (ok) {
+		periods_changed_us = time_us_64();
+		periods_settle_us = period_icg_us;
+		period_sh_us = i2c_sh_us;
+		period_icg_us = i2c_icg_us;
+	}
+	i2c_ok = ok;
+	i2c_result = i2c_busy;
+	i2c_busy = 0;
+}
+
+void i2c_irq_handler()
+{
+	i2c_hw_t* hw = i2c_get_hw(i2c0);
+	uint32_t stat = hw->raw_intr_stat;
+	bool aborted = stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS;
+	if (aborted) (void) hw->clr_tx_abrt;
+	(void) hw->clr_stop_det;
+	// After an abort, the STOP may come with a later interrupt.
+	if (i2c_busy) i2c_finish(!aborted);
+}
+
+void i2c_link_init()
+{
+	i2c_hw_t* hw = i2c_get_hw(i2c0);
+	hw->intr_mask = I2C_IC_INTR_MASK_M_TX_ABRT_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS;
+	irq_set_exclusive_handler(I2C0_IRQ, i2c_irq_handler);
+	irq_set_enabled(I2C0_IRQ, true);
+}
+
+bool start_periods_message(uint16_t us_SH, uint16_t us_ICG, uint8_t who)
+// Start sending the SH and ICG periods to the PIC18.
+// Returns false if a message is already in flight.
+{
+	if (i2c_busy) return false;
+	// Big-endian layout of bytes in message.
+	msg_bytes[0] = (uint8_t) ((us_SH & 0xff00) >> 8);
+	msg_bytes[1] = (uint8_t) (us_SH & 0x00ff);
+	msg_bytes[2] = (uint8_t) ((us_ICG & 0xff00) >> 8);
+	msg_bytes[3] = (uint8_t) (us_ICG & 0x00ff);
+	i2c_hw_t* hw = i2c_get_hw(i2c0);
+	hw->enable = 0;
+	hw->tar = PIC18_I2C_ADDR;
+	hw->enable = I2C_IC_ENABLE_ENABLE_BITS;
+	(void) hw->clr_intr; // anything left over from the previous message
+	i2c_sh_us = us_SH;
+	i2c_icg_us = us_ICG;
+	i2c_started_us = time_us_32();
+	i2c_aborting = false;
+	i2c_busy = who;
+	for (int k=0; k < 4; ++k) {
+		hw->data_cmd = msg_bytes[k] | ((k == 3) ? I2C_IC_DATA_CMD_STOP_BITS : 0);
+	}
+	return true;
+}
+
+void service_i2c()
+// Called from the main loop; never waits.
+{
+	if (i2c_busy) {
+		uint32_t elapsed = time_us_32() - i2c_started_us;
+		if (elapsed < I2C_TIMEOUT_US) return;
+		i2c_hw_t* hw = i2c_get_hw(i2c0);
+		if (!i2c_aborting) {
+			// The abort raises TX_ABRT, and the interrupt finishes the message.
+			hw->enable = I2C_IC_ENABLE_ENABLE_BITS | I2C_IC_ENABLE_ABORT_BITS;
+			i2c_aborting = true;
+			return;
+		}
+		if (elapsed < 2*I2C_TIMEOUT_US) return;
+		// The bus is stuck; start again with the next message.
+		uint32_t save = save_and_disable_interrupts();
+		if (i2c_busy) i2c_finish(false);
+		restore_interrupts(save);
+		return;
+	}
+	uint8_t who = i2c_result;
+	if (!who) return;
+	i2c_result = 0;
+	if (who == PERIODS_BY_COMMAND) {
+		tx_wait();
+		if (i2c_ok) {
+			printf("p %d %d\n", i2c_sh_us, i2c_icg_us);
+		} else {
+			printf("p error: unsuccessful I2C communication\n");
+		}
+	} else if (who == PERIODS_BY_AE && i2c_ok) {
+		ae_changes++;
+	}
+}
+
+// Automatic exposure control.
+// The exposure of each frame is the SH period. For every frame that was
+// exposed with the present periods, the light signal at ae_percentile
+// (from the histogram, as for the g report) is compared with ae_target and
+// the SH period is scaled in proportion, since the signal above the dark
+// level grows with the exposure. The step is limited to a factor of 4 and,
+// if the level is at or above the saturation level, the SH period is halved.
+// Within AE_DEADBAND of the target, nothing is changed.
+// The ICG period is kept, and the new SH period is the nearest that
+// divides it exactly (and is at least AE_MIN_SH microseconds), so the
+// signals from the PIC18 stay aligned. The SH period in force is in the
+// metadata of each frame.
+#define AE_DEADBAND 0.05f
+#define AE_MIN_SH 10
+uint16_t ae_target = 0; // zero when automatic exposure is off
+float ae_percentile = 99.0f;
+
+uint16_t nearest_sh_divisor(uint16_t icg, float sh)
+{
+	uint32_t best = 0;
+	float best_err = 0.0f;
+	for (uint32_t k=1; icg / k >= AE_MIN_SH; ++k) {
+		if (icg % k) continue;
+		float err = fabsf((float)(icg / k) - sh);
+		if (best == 0 || err < best_err) {
+			best = icg / k;
+			best_err = err;
+		}
+	}
+	return (uint16_t)((best) ? best : icg);
+}
+
+void auto_exposure(const frame_t* f)
+{
+	if (ae_target == 0 || i2c_busy) return;
+	// The frame that follows a change might have had the old exposure.
+	if (!frame_periods_settled(f)) return;
+	build_histogram(f);
+	float level = (float)histogram_percentile(ae_percentile);
+	float sh = (float)period_sh_us;
+	float new_sh;
+	if (level >= sat_level) {
+		new_sh = sh / 2.0f;
+	} else {
+		float signal = level - (float)dark_level;
+		float wanted = (float)ae_target - (float)dark_level;
+		if (signal < 1.0f) signal = 1.0f;
+		float ratio = wanted / signal;
+		if (fabsf(ratio - 1.0f) < AE_DEADBAND) return;
+		if (ratio > 4.0f) ratio = 4.0f;
+		if (ratio < 0.25f) ratio = 0.25f;
+		new_sh = sh * ratio;
+	}
+	uint16_t icg = period_icg_us;
+	uint16_t us_SH = nearest_sh_divisor(icg, new_sh);
+	if (us_SH == period_sh_us) return;
+	start_periods_message(us_SH, icg, PERIODS_BY_AE); // or wait for the next frame
+}
+
+void observe_idle_frames()
+// When we are not streaming, the frames are just given back to core 1,
+// after automatic exposure has had a look at them.
+{
+	frame_t* f;
+	while ((f = frame_queue_pop(&ready_frames))) {
+		auto_exposure(f);
+		frame_queue_push(&free_frames, f);
+	}
+}
+
+// Streaming: every stream_every'th frame is reported as soon as possible
+// after it arrives, without a request from the PC, until the stream is stopped.
+// Core 0 takes the frames from the ready queue and holds those that are due
+// in a small queue of its own (up to stream_depth frames) while an earlier
+// report is still being sent. When that queue is full, either the oldest
+// frame in it or the newly arrived frame is dropped.
+// Frames that core 1 could not capture into a buffer are counted as dropped, too.
+#define STREAM_DEPTH_MAX (N_FRAMES - 3) // core 0 also holds report_frame; core 1 needs two
+uint32_t stream_every = 0; // zero when not streaming
+char stream_format = 'Q';
+uint32_t stream_next_seq = 0;
+bool stream_first = false; // the next frame to arrive is due, whatever its seq
+uint8_t stream_depth = 2;
+bool stream_drop_oldest = true;
+frame_t* stream_queue[STREAM_DEPTH_MAX];
+uint8_t stream_queued = 0;
+uint32_t stream_sent = 0;
+uint32_t stream_drops_base = 0; // stream_drops when the stream started
+uint32_t stream_core1_base = 0; // frames_dropped when the stream started
+
+void start_stream(uint32_t every, char fmt)
+{
+	stream_every = every;
+	stream_format = fmt;
+	stream_first = true;
+	stream_queued = 0;
+	stream_sent = 0;
+	stream_drops_base = stream_drops;
+	stream_core1_base = frames_dropped;
+	sparse_sent_n = 0; // so that a sparse stream starts with a keyframe
+	discard_ready_frames();
+}
+
+uint32_t stream_dropped_total()
+{
+	return (stream_drops - stream_drops_base) + (frames_dropped - stream_core1_base);
+}
+
+void stop_stream()
+{
+	for (uint8_t j=0; j < stream_queued; ++j) {
+		frame_queue_push(&free_frames, stream_queue[j]);
+	}
+	stream_queued = 0;
+	stream_every = 0;
+}
+
+void service_stream()
+// Called from the main loop; never waits.
+{
+	frame_t* f;
+	while ((f = frame_queue_pop(&ready_frames))) {
+		auto_exposure(f);
+		bool due = stream_first || (int32_t)(f->seq - stream_next_seq) >= 0;
+		if (!due || !frame_periods_settled(f)) {
+			frame_queue_push(&free_frames, f);
+			continue;
+		}
+		stream_first = false;
+		stream_next_seq = f->seq + stream_every;
+		if (stream_queued == stream_depth) {
+			stream_drops++;
+			if (!stream_drop_oldest) {
+				frame_queue_push(&free_frames, f);
+				continue;
+			}
+			frame_queue_push(&free_frames, stream_queue[0]);
+			memmove(&stream_queue[0], &stream_queue[1], (stream_queued-1)*sizeof(frame_t*));
+			stream_queued--;
+		}
+		stream_queue[stream_queued++] = f;
+	}
+	if (stream_queued == 0) return;
+	// Only start a report when the previous one has gone,
+	// so that the (DMA) transmission does not hold us up.
+	if (tx_uses_dma() && dma_channel_is_busy(tx_dma_chan)) return;
+	f = stream_queue[0];
+	stream_queued--;
+	memmove(&stream_queue[0], &stream_queue[1], stream_queued*sizeof(frame_t*));
+	send_report(stream_format, f);
+	frame_queue_push(&free_frames, f);
+	stream_sent++;
+}
+
+// For benchmarks, the SysTick of core 0 counts down at the system clock.
+// It has 24 bits, so it can time things up to about 100 ms.
+void cycle_counter_init()
+{
+	systick_hw->rvr = 0x00ffffff;
+	systick_hw->cvr = 0;
+	systick_hw->csr = 0x5; // enabled, processor clock, no interrupt
+}
+
+static inline uint32_t cycles_since(uint32_t start)
+{
+	return (start - systick_hw->cvr) & 0x00ffffff;
+}
+
+void benchmark(const char* kernel)
+// Times a reference and a fast version of a kernel on the report samples,
+// checks that they agree and reports the cycles per sample for each.
+{
+	size_t n = gather_report_samples(report_frame);
+	uint32_t ref_cycles = 0;
+	uint32_t fast_cycles = 0;
+	bool match = false;
+	char* ref_buf = (char*)tx_bufs[0];
+	char* fast_buf = (char*)tx_bufs[1];
+	if (strcmp(kernel, "q") == 0) {
+		bool wide = report_is_wide();
+		uint32_t t0 = systick_hw->cvr;
+		size_t ref_len = encode_base64_report_simple(report_samples, n, wide, ref_buf);
+		ref_cycles = cycles_since(t0);
+		t0 = systick_hw->cvr;
+		size_t fast_len = encode_base64_report(report_samples, n, wide, fast_buf);
+		fast_cycles = cycles_since(t0);
+		match = (ref_len == fast_len) && (memcmp(ref_buf, fast_buf, ref_len) == 0);
+	} else if (strcmp(kernel, "r") == 0) {
+		uint32_t t0 = systick_hw->cvr;
+		size_t ref_len = encode_decimal_report_simple(report_samples, n, ref_buf);
+		ref_cycles = cycles_since(t0);
+		t0 = systick_hw->cvr;
+		size_t fast_len = encode_decimal_report(report_samples, n, fast_buf);
+		fast_cycles = cycles_since(t0);
+		match = (ref_len == fast_len) && (memcmp(ref_buf, fast_buf, ref_len) == 0);
+	} else if (strcmp(kernel, "s") == 0) {
+		// The stats of the whole frame, rather than of the report samples.
+		// Neither version changes the samples, and the frame is left
+		// with the stats from frame_stats, as it had before.
+		frame_t* f = report_frame;
+		uint32_t t0 = systick_hw->cvr;
+		frame_stats_simple(f);
+		ref_cycles = cycles_since(t0);
+		float ref_mean = f->mean;
+		float ref_stddev = f->stddev;
+		t0 = systick_hw->cvr;
+		frame_stats(f);
+		fast_cycles = cycles_since(t0);
+		n = N_SAMPLES;
+		match = fabsf(ref_mean - f->mean) < 0.01f && fabsf(ref_stddev - f->stddev) < 0.01f;
+	} else if (strcmp(kernel, "sum") == 0 || strcmp(kernel, "sumsq") == 0 ||
+			   strcmp(kernel, "stats") == 0) {
+		// The packed kernels on the whole frame.
+		const uint16_t* x = report_frame->samples;
+		n = N_SAMPLES;
+		uint32_t t0 = systick_hw->cvr;
+		if (strcmp(kernel, "sum") == 0) {
+			uint32_t ref = dsp_sum_u16_ref(x, n);
+			ref_cycles = cycles_since(t0);
+			t0 = systick_hw->cvr;
+			uint32_t fast = dsp_sum_u16(x, n);
+			fast_cycles = cycles_since(t0);
+			match = (ref == fast);
+		} else if (strcmp(kernel, "sumsq") == 0) {
+			uint64_t ref = dsp_sumsq_u16_ref(x, n);
+			ref_cycles = cycles_since(t0);
+			t0 = systick_hw->cvr;
+			uint64_t fast = dsp_sumsq_u16(x, n);
+			fast_cycles = cycles_since(t0);
+			match = (ref == fast);
+		} else {
+			dsp_stats_t ref, fast;
+			dsp_stats_u16_ref(x, n, &ref);
+			ref_cycles = cycles_since(t0);
+			t0 = systick_hw->cvr;
+			dsp_stats_u16(x, n, &fast);
+			fast_cycles = cycles_since(t0);
+			match = (ref.sum == fast.sum) && (ref.sumsq == fast.sumsq) &&
+				(ref.min == fast.min) && (ref.max == fast.max);
+		}
+	} else if (strcmp(kernel, "acc") == 0 || strcmp(kernel, "bin") == 0 ||
+			   strcmp(kernel, "dark") == 0) {
+		// The packed kernels that write a buffer, into the transmit buffers.
+		const uint16_t* x = report_frame->samples;
+		uint16_t* ref = (uint16_t*)tx_bufs[0];
+		uint16_t* fast = (uint16_t*)tx_bufs[1];
+		n = N_SAMPLES;
+		size_t nout = n;
+		uint32_t t0;
+		if (kernel[0] == 'a') {
+			// Accumulate the frame on top of itself.
+			memcpy(ref, x, n*sizeof(uint16_t));
+			memcpy(fast, x, n*sizeof(uint16_t));
+			t0 = systick_hw->cvr;
+			dsp_accumulate_u16_ref(ref, x, n);
+			ref_cycles = cycles_since(t0);
+			t0 = systick_hw->cvr;
+			dsp_accumulate_u16(fast, x, n);
+			fast_cycles = cycles_since(t0);
+		} else if (kernel[0] == 'b') {
+			// Bins of 4 samples.
+			nout = n/4;
+			t0 = systick_hw->cvr;
+			dsp_bin_sum_u16_ref(ref, x, nout, 4);
+			ref_cycles = cycles_since(t0);
+			t0 = systick_hw->cvr;
+			dsp_bin_sum_u16(fast, x, nout, 4);
+			fast_cycles = cycles_since(t0);
+		} else {
+			t0 = systick_hw->cvr;
+			dsp_dark_subtract_u16_ref(ref, dark_ref, x, n);
+			ref_cycles = cycles_since(t0);
+			t0 = systick_hw->cvr;
+			dsp_dark_subtract_u16(fast, dark_ref, x, n);
+			fast_cycles = cycles_since(t0);
+		}
+		match = (memcmp(ref, fast, nout*sizeof(uint16_t)) == 0);
+	} else {
+		printf("y error: kernel should be one of q r s sum sumsq stats acc bin dark\n");
+		return;
+	}
+	float per_sample = 1.0f / (float)((n) ? n : 1);
+	printf("y %s %.2f %.2f %d\n", kernel, ref_cycles*per_sample, fast_cycles*per_sample, match);
+}
 
 void interpret_command(char* cmdStr)
 // A command that does not do what is expected should return a message
@@ -96,10 +2078,25 @@ void interpret_command(char* cmdStr)
     uint8_t i;
     // printf("DEBUG: cmdStr=%s", cmdStr);
     if (!override_led) gpio_put(LED_PIN, 1); // To indicate start of interpreter activity.
+    tx_wait(); // Any report still being sent must go out before our response.
     switch (cmdStr[0]) {
 	case 'v':
 		printf("v %s\n", VERSION_STR);
 		break;
+	case 'i':
+		// Report the input buffer: the number of characters waiting and
+		// the number dropped because the buffer was full.
+		// i 0\n resets the count of dropped characters.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			if (atoi(token_ptr) != 0) {
+				printf("i error: the dropped count can only be reset to 0\n");
+				break;
+			}
+			rx_overflows = 0;
+		}
+		printf("i %u %u\n", rx_head - rx_tail, rx_overflows);
+		break;
 	case 'L':
 		// Turn LED on or off.
 		// Turning the LED on by command overrides its use
@@ -118,52 +2115,505 @@ void interpret_command(char* cmdStr)
 		}
 		break;
 	case 'a':
-		// Sample the previously-initialized ADC channel.
-		uint adc_raw = adc_read();
+		// Report the most recent conversion of the previously-initialized ADC channel.
+		// Core 1 owns the ADC, so we do not start a conversion of our own.
+		uint adc_raw = adc_hw->result;
 		printf("a %u\n", adc_raw);
 		break;
 	case 'b':
 		// We want the sampling to start immediately on the rise of the ICG signal.
-		while (gpio_get(ICG_PIN)) { /* wait */ }
-		while (!gpio_get(ICG_PIN)) { /* wait */ }
-		// Capture a batch of samples from the previously-initialized ADC channel.
-		uint32_t start = time_us_32();
-		adc_capture(adc_samples, N_SAMPLES);
-		uint32_t time_taken = time_us_32() - start;
-		float n = (float)N_SAMPLES;
-		float mean = 0;
-		for (size_t j=0; j < N_SAMPLES; ++j) {
-			mean += (float)adc_samples[j];
-		}
-		mean /= n;
-		float variance = 0;
-		for (size_t j=0; j < N_SAMPLES; ++j) {
-			float diff = (float)adc_samples[j] - mean;
-			variance += diff * diff;
-		}
-		float stddev = sqrt(variance/(n-1.0f));
-		printf("b %g %g %u\n", mean, stddev, time_taken);
+		// The ADC is started by the PIO+DMA trigger, so the latency is fixed.
+		// Core 1 captures every frame, so we just wait for the next one
+		// to complete; its stats have already been computed.
+		frame_t* f = take_fresh_frame();
+		if (!f) {
+			printf("b error: aborted\n");
+			break;
+		}
+		printf("b %g %g %u %u %u %u %u %u\n", f->mean, f->stddev, f->time_taken, frame_latency_ns(f),
+			   f->min, f->max, f->argmax, frame_trigger_latency_ns(f));
+		break;
+	case 'k':
+		// Co-add a number of consecutive frames.
+		// The per-pixel mean becomes the frame that is reported by r and q.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int nframes = atoi(token_ptr);
+			if (nframes < 1 || nframes > 65535) {
+				printf("k error: number of frames should be 1..65535\n");
+				break;
+			}
+			int nmissed = coadd_frames((uint32_t)nframes);
+			if (nmissed < 0) {
+				printf("k error: aborted\n");
+				break;
+			}
+			if (nmissed) {
+				printf("k error: missed %d frames\n", nmissed);
+				break;
+			}
+			frame_t* f = report_frame;
+			printf("k %g %g %u %u %d %u %u %u %u\n", f->mean, f->stddev, f->time_taken, frame_latency_ns(f),
+				   nframes, f->min, f->max, f->argmax, frame_trigger_latency_ns(f));
+		} else {
+			printf("k error: no value for number of frames\n");
+		}
+		break;
+	case 'd':
+	case 'f':
+		// Capture a dark (d) or flat (f) reference frame, optionally
+		// averaged over a number of consecutive frames.
+		// The dark frame should be taken with the sensor covered.
+		// Taking a new dark frame resets the flat-field gains to unity,
+		// so the flat frame should be taken after the dark frame.
+		{
+			char cmd = cmdStr[0];
+			int nframes = 1;
+			token_ptr = strtok(&cmdStr[1], sep_tok);
+			if (token_ptr) nframes = atoi(token_ptr);
+			if (nframes < 1 || nframes > 65535) {
+				printf("%c error: number of frames should be 1..65535\n", cmd);
+				break;
+			}
+			if (cmd == 'f' && !have_dark_ref) {
+				printf("f error: no dark reference\n");
+				break;
+			}
+			bool was_wanted = correction_wanted;
+			pause_correction();
+			int nmissed = coadd_frames((uint32_t)nframes);
+			if (nmissed < 0) {
+				printf("%c error: aborted\n", cmd);
+			} else if (nmissed) {
+				printf("%c error: missed %d frames\n", cmd, nmissed);
+			} else {
+				if (cmd == 'd') {
+					memcpy(dark_ref, coadd_frame.samples, sizeof(dark_ref));
+					have_dark_ref = true;
+					set_unity_gain();
+				} else {
+					set_flat_gain(coadd_frame.samples);
+				}
+				printf("%c %g %g %d\n", cmd, coadd_frame.mean, coadd_frame.stddev, nframes);
+			}
+			correction_wanted = was_wanted && have_dark_ref;
+		}
+		break;
+	case 'n':
+		// Turn the dark and flat correction on or off.
+		// With no value, just report the state.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			i = (uint8_t) (atoi(token_ptr) & 1);
+			if (i && !have_dark_ref) {
+				printf("n error: no dark reference\n");
+				break;
+			}
+			correction_wanted = i;
+		}
+		printf("n %d %d %d\n", correction_wanted, have_dark_ref, have_flat_ref);
+		break;
+	case 't':
+		// Set the ADC clock divider and the sampling phase.
+		// For example, t 95 120\n gives one sample every 96 ADC clocks
+		// (500 ksps, matching the pixel rate) starting 120 system-clock
+		// cycles after the ICG edge. t 0 0\n gives the default free-running ADC.
+		// The delay is limited to less than one pixel period (see max_icg_delay).
+		// With no values, just report the present settings.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			float clkdiv = (float) atof(token_ptr);
+			int delay = (int) icg_delay;
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) delay = atoi(token_ptr);
+			if (clkdiv != 0.0f && (clkdiv < 95.0f || clkdiv > 65535.0f)) {
+				printf("t error: clock divider should be 0 or 95..65535\n");
+				break;
+			}
+			if (delay < 0 || (uint32_t) delay > max_icg_delay()) {
+				printf("t error: delay should be 0..%u\n", max_icg_delay());
+				break;
+			}
+			set_timing(clkdiv, (uint32_t) delay);
+		}
+		printf("t %g %u\n", adc_clkdiv, icg_delay);
+		break;
+	case 'T':
+		// Sweep the sampling phase across one pixel period and
+		// keep the phase that gives the sharpest frame.
+		// The optional value is the step in system-clock cycles.
+		// Best done with some structure (e.g. spectral lines) in the light.
+		{
+			int step = 10;
+			token_ptr = strtok(&cmdStr[1], sep_tok);
+			if (token_ptr) step = atoi(token_ptr);
+			if (step < 1 || (uint32_t) step > max_icg_delay()) {
+				printf("T error: step should be 1..%u\n", max_icg_delay());
+				break;
+			}
+			uint32_t best_contrast;
+			uint32_t best_delay = sweep_phase((uint32_t) step, &best_contrast);
+			if (abort_requested) {
+				printf("T error: aborted\n");
+				break;
+			}
+			printf("T %u %u\n", best_delay, best_contrast);
+		}
 		break;
 	case 'r':
 		// Report the values of previously-captured analog values.
 		// Each uint16 value is formatted as a decimal integer and there is one per line.
-		for (size_t j=0; j < N_SAMPLES; ++j) {
-			printf("%u\n", adc_samples[j]);
-		}
-		break;
+		// Only the samples within the region of interest are reported.
 	case 'q':
 		// Quickly report the values of previously-captured analog values.
 		// Each 12-bit value is formatted as a pair of characters using the base64 alphabet.
-		// There are 20 values per line so N_SAMPLES needs to be an exact multiple of 20.
-		for (size_t j=0; j < N_SAMPLES/20; ++j) {
-			for (size_t k=0; k < 20; ++k) {
-				uint16_t val = adc_samples[j*20 + k];
-				char hi = base64_alphabet[(val & 0x0FFF) >> 6];
-				char lo = base64_alphabet[val & 0x003F];
-				printf("%c%c", hi, lo);
+		// When summed bins may need more than 12 bits, three characters are used.
+		// There are 20 values per line, with the last line being shorter
+		// if the number of samples in the region of interest is not a multiple of 20.
+	case 'Q':
+		// Report the values of previously-captured analog values as
+		// a single binary packet (see begin_packet), with 12-bit values
+		// packed two into 3 bytes.
+	case 'z':
+		// Report the values of previously-captured analog values as
+		// a single binary packet, compressed with Rice coding (see rice_encode).
+	case 'u':
+		// Report the values of previously-captured analog values as
+		// a sparse update (see report_sparse) or, when needed, a keyframe.
+	case 'e':
+		// Report the peaks (see find_peaks) in the previously-captured frame,
+		// as a single line.
+		send_report(cmdStr[0], report_frame);
+		break;
+	case 'g':
+		// Report the histogram stats of the light signal in the present frame
+		// (see report_histogram), for exposure decisions without the frame itself.
+		report_histogram(report_frame);
+		break;
+	case 'G':
+		// Set the saturation and dark levels for the g report and,
+		// optionally, up to 8 percentiles.
+		// For example, G 4000 50 1 50 99.9\n
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int sat = atoi(token_ptr);
+			int dark = dark_level;
+			float new_pcts[MAX_PERCENTILES];
+			uint8_t n_new = 0;
+			bool ok = true;
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) {
+				dark = atoi(token_ptr);
+				token_ptr = strtok(NULL, sep_tok);
+			}
+			while (token_ptr) {
+				if (n_new == MAX_PERCENTILES) {
+					printf("G error: too many percentiles\n");
+					ok = false; break;
+				}
+				float pct = (float) atof(token_ptr);
+				if (pct < 0.0f || pct > 100.0f) {
+					printf("G error: percentiles should be 0..100\n");
+					ok = false; break;
+				}
+				new_pcts[n_new++] = pct;
+				token_ptr = strtok(NULL, sep_tok);
+			}
+			if (!ok) break;
+			if (sat < 0 || sat > 4095 || dark < 0 || dark > 4095) {
+				printf("G error: levels should be 0..4095\n");
+				break;
+			}
+			sat_level = (uint16_t) sat;
+			dark_level = (uint16_t) dark;
+			if (n_new > 0) {
+				memcpy(percentiles, new_pcts, n_new*sizeof(float));
+				n_percentiles = n_new;
+			}
+		}
+		printf("G %u %u", sat_level, dark_level);
+		for (uint8_t m=0; m < n_percentiles; ++m) { printf(" %g", percentiles[m]); }
+		printf("\n");
+		break;
+	case 'A':
+		// Automatic exposure: adjust the SH period so that the light signal
+		// at the given percentile (default 99) is near the target level.
+		// For example, A 3000 99.5\n
+		// A 0\n turns it off. With no values, just report the state,
+		// which includes the present SH and ICG periods and the number
+		// of changes that have been made.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int target = atoi(token_ptr);
+			float pct = ae_percentile;
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) pct = (float) atof(token_ptr);
+			if (target < 0 || target > 4095 || (target > 0 && target <= dark_level)) {
+				printf("A error: target should be 0 (off) or above the dark level, up to 4095\n");
+				break;
+			}
+			if (pct < 0.0f || pct > 100.0f) {
+				printf("A error: percentile should be 0..100\n");
+				break;
+			}
+			ae_target = (uint16_t) target;
+			ae_percentile = pct;
+			ae_changes = 0;
+		}
+		printf("A %u %g %u %u %u\n", ae_target, ae_percentile, period_sh_us, period_icg_us, ae_changes);
+		break;
+	case 'E':
+		// Set the threshold and the prominence for peak detection and,
+		// optionally, the refinement: parabola (p) or centroid (c).
+		// For example, E 200 100 c\n
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int threshold = atoi(token_ptr);
+			int prominence = peak_prominence;
+			bool centroid = peak_centroid;
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) {
+				prominence = atoi(token_ptr);
+				token_ptr = strtok(NULL, sep_tok);
+				if (token_ptr) {
+					if (token_ptr[0] != 'p' && token_ptr[0] != 'c') {
+						printf("E error: refinement should be p or c\n");
+						break;
+					}
+					centroid = (token_ptr[0] == 'c');
+				}
+			}
+			if (threshold < 0 || threshold > 65535 || prominence < 1 || prominence > 65535) {
+				printf("E error: threshold should be 0..65535 and prominence 1..65535\n");
+				break;
+			}
+			peak_threshold = (uint16_t) threshold;
+			peak_prominence = (uint16_t) prominence;
+			peak_centroid = centroid;
+		}
+		printf("E %u %u %c\n", peak_threshold, peak_prominence, (peak_centroid) ? 'c' : 'p');
+		break;
+	case 's':
+		// Start streaming every Nth frame, in the format of one of
+		// the report commands (r, q, Q, z, u or e; default Q).
+		// For example, s 1 z\n streams every frame, compressed.
+		// s 0\n stops the stream and reports the number of frames sent
+		// and the number dropped. With no value, just report the state.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int every = atoi(token_ptr);
+			if (every < 0) {
+				printf("s error: interval should be 0 (stop) or at least 1\n");
+				break;
+			}
+			if (every == 0) {
+				stop_stream();
+				printf("s 0 %u %u\n", stream_sent, stream_dropped_total());
+				break;
+			}
+			char fmt = 'Q';
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) fmt = token_ptr[0];
+			if (!report_format_ok(fmt)) {
+				printf("s error: format should be one of r q Q z u e\n");
+				break;
+			}
+			stop_stream();
+			printf("s %d %c\n", every, fmt);
+			start_stream((uint32_t) every, fmt);
+			break;
+		}
+		printf("s %u %c %u %u\n", stream_every, stream_format, stream_sent, stream_dropped_total());
+		break;
+	case 'm':
+		// Set the depth of the streaming queue and the drop policy,
+		// o to drop the oldest frame or n to drop the newest, when it is full.
+		// For example, m 2 o\n
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int depth = atoi(token_ptr);
+			if (depth < 1 || depth > STREAM_DEPTH_MAX) {
+				printf("m error: depth should be 1..%d\n", STREAM_DEPTH_MAX);
+				break;
+			}
+			bool drop_oldest = stream_drop_oldest;
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) {
+				if (token_ptr[0] != 'o' && token_ptr[0] != 'n') {
+					printf("m error: policy should be o or n\n");
+					break;
+				}
+				drop_oldest = (token_ptr[0] == 'o');
+			}
+			// Frames beyond the new depth are dropped as for a full queue.
+			while (stream_queued > depth) {
+				uint8_t j = (drop_oldest) ? 0 : stream_queued - 1;
+				frame_queue_push(&free_frames, stream_queue[j]);
+				memmove(&stream_queue[j], &stream_queue[j+1], (stream_queued-1-j)*sizeof(frame_t*));
+				stream_queued--;
+				stream_drops++;
+			}
+			stream_depth = (uint8_t) depth;
+			stream_drop_oldest = drop_oldest;
+		}
+		printf("m %u %c\n", stream_depth, (stream_drop_oldest) ? 'o' : 'n');
+		break;
+	case 'h':
+		// Turn the metadata line at the start of the r and q reports on or off.
+		// The binary packets always have the metadata in their header.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) text_header = (bool) (atoi(token_ptr) & 1);
+		printf("h %d\n", text_header);
+		break;
+	case 'U':
+		// Set the keyframe interval and the change threshold for sparse updates.
+		// For example, U 50 8\n
+		// In any case, the next sparse report will be a keyframe.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int interval = atoi(token_ptr);
+			if (interval < 1) {
+				printf("U error: keyframe interval should be at least 1\n");
+				break;
+			}
+			int threshold = sparse_threshold;
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) threshold = atoi(token_ptr);
+			if (threshold < 0 || threshold > 4095) {
+				printf("U error: threshold should be 0..4095\n");
+				break;
+			}
+			sparse_key_interval = (uint32_t) interval;
+			sparse_threshold = (uint16_t) threshold;
+		}
+		sparse_sent_n = 0;
+		printf("U %u %u\n", sparse_key_interval, sparse_threshold);
+		break;
+	case 'o':
+		// Select where the frame data (from r, q, Q, z, u and e) is sent:
+		// 0 to all stdio drivers, 1 to USB only, 2 to the UART only.
+		// The command responses always go to all of the drivers.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int output = atoi(token_ptr);
+#if TCD1304_USB_DATA
+			if (output < 0 || output > 2) {
+				printf("o error: output should be 0, 1 or 2\n");
+				break;
+			}
+#else
+			if (output != 0) {
+				printf("o error: no USB data path in this build\n");
+				break;
 			}
-			printf("\n");
+#endif
+			data_output = (uint8_t) output;
 		}
+		printf("o %d\n", data_output);
+		break;
+	case 'y':
+		// Benchmark a processing kernel on the report samples.
+		// For example, y q\n times the encoder for the q report.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			benchmark(token_ptr);
+		} else {
+			printf("y error: no kernel named\n");
+		}
+		break;
+	case 'w':
+		// Set the region of interest as one or more windows, each given
+		// as a start index and a length, in increasing order.
+		// For example, w 100 300 2000 50\n
+		// w 0 3800\n restores the full frame.
+		// With no values, just report the present windows.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			window_t new_roi[MAX_WINDOWS];
+			uint8_t n_new = 0;
+			bool ok = true;
+			uint32_t next_free = 0;
+			while (token_ptr && ok) {
+				if (n_new == MAX_WINDOWS) {
+					printf("w error: too many windows\n");
+					ok = false; break;
+				}
+				long start = atol(token_ptr);
+				token_ptr = strtok(NULL, sep_tok);
+				if (!token_ptr) {
+					printf("w error: no length for window\n");
+					ok = false; break;
+				}
+				long len = atol(token_ptr);
+				// Written so that nothing can overflow, whatever the values.
+				if (start < (long)next_free || start >= N_SAMPLES ||
+					len < 1 || len > N_SAMPLES - start) {
+					printf("w error: windows should be in order, within 0..%d\n", N_SAMPLES);
+					ok = false; break;
+				}
+				new_roi[n_new].start = (uint16_t) start;
+				new_roi[n_new].len = (uint16_t) len;
+				n_new++;
+				next_free = (uint32_t)(start + len);
+				token_ptr = strtok(NULL, sep_tok);
+			}
+			if (!ok) break;
+			memcpy(roi, new_roi, sizeof(roi));
+			n_roi = n_new;
+			sparse_sent_n = 0; // The next sparse report will be a keyframe.
+		}
+		printf("w");
+		for (uint8_t w=0; w < n_roi; ++w) {
+			printf(" %u %u", roi[w].start, roi[w].len);
+		}
+		printf("\n");
+		break;
+	case 'x':
+		// Set the binning factor (1, 2, 4, 8 or 16) and, optionally,
+		// whether the bins are averaged (a) or summed (s).
+		// For example, x 4 s\n
+		// The response states the number of values in a report.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int factor = atoi(token_ptr);
+			uint8_t shift = 0;
+			while (shift < 4 && (1 << shift) < factor) { shift++; }
+			if ((1 << shift) != factor) {
+				printf("x error: factor should be 1, 2, 4, 8 or 16\n");
+				break;
+			}
+			token_ptr = strtok(NULL, sep_tok);
+			if (token_ptr) {
+				if (token_ptr[0] != 'a' && token_ptr[0] != 's') {
+					printf("x error: mode should be a or s\n");
+					break;
+				}
+				bin_sum = (token_ptr[0] == 's');
+			}
+			bin_shift = shift;
+			sparse_sent_n = 0;
+		}
+		printf("x %d %c %u\n", 1 << bin_shift, (bin_sum) ? 's' : 'a', report_length());
+		break;
+	case 'I':
+		// Set the speed of the I2C link to the PIC18, in kHz.
+		// The internal pull-ups are weak, so 100 kHz is the default;
+		// 400 kHz and 1 MHz need external pull-up resistors on SDA and SCL.
+		// The response gives the actual rate, in Hz.
+		token_ptr = strtok(&cmdStr[1], sep_tok);
+		if (token_ptr) {
+			int khz = atoi(token_ptr);
+			if (khz < 10 || khz > 1000) {
+				printf("I error: speed should be 10..1000 kHz\n");
+				break;
+			}
+			if (i2c_busy) {
+				printf("I error: I2C busy\n");
+				break;
+			}
+			i2c_baud = i2c_set_baudrate(i2c0, (uint) khz * 1000);
+		}
+		printf("I %u\n", i2c_baud);
 		break;
 	case 'p':
 		// Set the SH and ICG periods (counts of microseconds).
@@ -185,18 +2635,10 @@ void interpret_command(char* cmdStr)
 			token_ptr = strtok(NULL, sep_tok);
 			if (token_ptr) {
 				uint16_t us_ICG = (uint16_t) atoi(token_ptr);
-				// Big-endian layout of bytes in message.
-				msg_bytes[0] = (uint8_t) ((us_SH & 0xff00) >> 8);
-				msg_bytes[1] = (uint8_t) (us_SH & 0x00ff);
-				msg_bytes[2] = (uint8_t) ((us_ICG & 0xff00) >> 8);
-				msg_bytes[3] = (uint8_t) (us_ICG & 0x00ff);
-				uint8_t addr = 0x51;
-				int nresult = i2c_write_blocking(i2c0, addr, msg_bytes, 4, false);
-				if (nresult != 4) {
-					printf("p error: unsuccessful I2C communication\n");
-				} else {
-					// Successfully sent the I2C message; report the values sent.
-					printf("p %d %d\n", us_SH, us_ICG);
+				// The response, with the values sent, comes from service_i2c()
+				// once the I2C message has been sent.
+				if (!start_periods_message(us_SH, us_ICG, PERIODS_BY_COMMAND)) {
+					printf("p error: I2C busy\n");
 				}
 			} else {
 				printf("p error: no value for us_ICG\n");
@@ -232,25 +2674,50 @@ int main()
     adc_init();
     adc_gpio_init(ADC_PIN);
     adc_select_input(0);
-	adc_fifo_setup(true, false, 0, false, false); // Just the FIFO, not the DMA
+	adc_fifo_setup(true, true, 1, false, false); // FIFO with DREQ asserted for each sample
+	set_unity_gain();
+	crc32_init();
+	tx_init();
+	rx_init();
+	cycle_counter_init();
+	for (uint j=1; j < N_FRAMES; ++j) { frame_queue_push(&free_frames, &frames[j]); }
+	multicore_launch_core1(core1_main);
 	//
-	i2c_init(i2c0, 100*1000);
+	i2c_baud = i2c_init(i2c0, i2c_baud);
+	i2c_link_init();
 	gpio_set_function(SDA_PIN, GPIO_FUNC_I2C);
 	gpio_set_function(SCL_PIN, GPIO_FUNC_I2C);
 	gpio_pull_up(SDA_PIN);
 	gpio_pull_up(SCL_PIN);
     //
     while (1) {
+        if (abort_requested) {
+            // Ctrl-C also stops a stream.
+            // A command that was running has already given up.
+            abort_requested = false;
+            if (stream_every) {
+                stop_stream();
+                tx_wait();
+                printf("s 0 %u %u\n", stream_sent, stream_dropped_total());
+            }
+        }
         // Characters are not echoed as they are typed.
         // Backspace deleting is allowed.
         // NL (Ctrl-J) signals end of incoming string.
-        int m = getstr(bufA, NBUFA);
+        int m = poll_getstr(bufA, NBUFA, &bufA_len);
         // Note that the cmd string may be of zero length,
         // with the null character in the first place.
         // If that is the case, do nothing with it.
         if (m > 0) {
             interpret_command(bufA);
         }
+        service_i2c();
+        if (stream_every) {
+            service_stream();
+        } else {
+            // Keep the buffers free for core 1, so that it never has to drop a frame.
+            observe_idle_frames();
+        }
     }
     return 0;
 }
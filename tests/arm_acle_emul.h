@@ -0,0 +1,77 @@
+// arm_acle_emul.h
+// Plain-C versions of the few ACLE intrinsics used by dsp_kernels.c,
+// so that the packed kernels can be built and checked on the host.
+// dsp_kernels.c includes this in place of <arm_acle.h> when
+// DSP_KERNELS_EMULATE is defined and the compiler has no DSP extension.
+//
+// The GE flags that USUB16 sets and SEL reads are kept in a static variable,
+// as they are kept in the APSR on the device.
+//
+// 2026-10-16: for the host tests of the DSP kernels
+//
+#ifndef ARM_ACLE_EMUL_H
+#define ARM_ACLE_EMUL_H
+
+#include <stdint.h>
+
+static uint32_t acle_emul_ge; // one bit per byte lane, as in the APSR
+
+static inline int32_t acle_emul_lo(uint32_t w) { return (int16_t)(w & 0xffff); }
+static inline int32_t acle_emul_hi(uint32_t w) { return (int16_t)(w >> 16); }
+
+static inline int32_t __smlad(int32_t a, int32_t b, int32_t acc)
+// acc + a.lo*b.lo + a.hi*b.hi, with signed 16-bit lanes, modulo 2^32.
+{
+	int64_t r = (int64_t)acc
+		+ acle_emul_lo((uint32_t)a) * acle_emul_lo((uint32_t)b)
+		+ acle_emul_hi((uint32_t)a) * acle_emul_hi((uint32_t)b);
+	return (int32_t)(uint32_t)r;
+}
+
+static inline int64_t __smlald(int32_t a, int32_t b, int64_t acc)
+// As __smlad, but with a 64-bit accumulator.
+{
+	return acc
+		+ (int64_t)acle_emul_lo((uint32_t)a) * acle_emul_lo((uint32_t)b)
+		+ (int64_t)acle_emul_hi((uint32_t)a) * acle_emul_hi((uint32_t)b);
+}
+
+static inline uint32_t __usub16(uint32_t a, uint32_t b)
+// Lane-by-lane a - b, modulo 2^16. The GE bits of a lane are set where a >= b.
+{
+	uint32_t lo = ((a & 0xffff) - (b & 0xffff)) & 0xffff;
+	uint32_t hi = ((a >> 16) - (b >> 16)) & 0xffff;
+	acle_emul_ge = 0;
+	if ((a & 0xffff) >= (b & 0xffff)) acle_emul_ge |= 0x3;
+	if ((a >> 16) >= (b >> 16)) acle_emul_ge |= 0xc;
+	return lo | (hi << 16);
+}
+
+static inline uint32_t __sel(uint32_t a, uint32_t b)
+// Byte by byte, a where the GE bit is set, otherwise b.
+{
+	uint32_t r = 0;
+	for (int i=0; i < 4; ++i) {
+		uint32_t mask = 0xffu << (8*i);
+		r |= ((acle_emul_ge >> i) & 1) ? (a & mask) : (b & mask);
+	}
+	return r;
+}
+
+static inline uint32_t __uadd16(uint32_t a, uint32_t b)
+// Lane-by-lane a + b, modulo 2^16.
+{
+	uint32_t lo = ((a & 0xffff) + (b & 0xffff)) & 0xffff;
+	uint32_t hi = ((a >> 16) + (b >> 16)) & 0xffff;
+	return lo | (hi << 16);
+}
+
+static inline uint32_t __uqsub16(uint32_t a, uint32_t b)
+// Lane-by-lane a - b, saturated at zero.
+{
+	uint32_t lo = ((a & 0xffff) > (b & 0xffff)) ? (a & 0xffff) - (b & 0xffff) : 0;
+	uint32_t hi = ((a >> 16) > (b >> 16)) ? (a >> 16) - (b >> 16) : 0;
+	return lo | (hi << 16);
+}
+
+#endif
@@ -0,0 +1,138 @@
+// test_dsp_kernels.c
+// Host check of the packed DSP kernels against their scalar reference versions.
+// The intrinsics are emulated (see arm_acle_emul.h), so this exercises the
+// packed code paths: pairing of samples, the tails for odd lengths,
+// unaligned buffers and the edges of the 16-bit lanes.
+//
+// 2026-10-16: first version
+//
+#include "dsp_kernels.h"
+#include <stdio.h>
+#include <string.h>
+
+#if !DSP_KERNELS_EMULATE
+#error "build with DSP_KERNELS_EMULATE=1 so that the packed kernels are tested"
+#endif
+
+#define N_MAX 3800 // one full frame of the reader
+#define MAX_OFFSET 3
+
+static uint16_t x_buf[N_MAX + MAX_OFFSET];
+static uint16_t dark_buf[N_MAX + MAX_OFFSET];
+static uint16_t acc_a[N_MAX + MAX_OFFSET];
+static uint16_t acc_b[N_MAX + MAX_OFFSET];
+static uint16_t out_a[N_MAX + MAX_OFFSET];
+static uint16_t out_b[N_MAX + MAX_OFFSET];
+
+static int n_checks = 0;
+static int n_failures = 0;
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng()
+// xorshift32, so that the test data are the same on every host.
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+typedef enum { FILL_ZERO, FILL_FULL, FILL_MAX_EXACT, FILL_RANDOM, FILL_RAMP, N_FILLS } fill_t;
+static const char* fill_names[N_FILLS] = {"zero", "4095", "32767", "random", "ramp"};
+
+static void fill(uint16_t* buf, size_t n, fill_t how)
+{
+	for (size_t j=0; j < n; ++j) {
+		switch (how) {
+		case FILL_ZERO: buf[j] = 0; break;
+		case FILL_FULL: buf[j] = 4095; break;
+		case FILL_MAX_EXACT: buf[j] = 32767; break; // the largest value for exact results
+		case FILL_RANDOM: buf[j] = (uint16_t)(rng() & 0x0fff); break;
+		case FILL_RAMP: buf[j] = (uint16_t)(j & 0x0fff); break;
+		default: break;
+		}
+	}
+}
+
+static void check(int ok, const char* kernel, size_t n, size_t offset, fill_t how)
+{
+	n_checks++;
+	if (ok) return;
+	n_failures++;
+	printf("FAIL %s n=%u offset=%u fill=%s\n", kernel, (unsigned)n, (unsigned)offset, fill_names[how]);
+}
+
+static void test_reductions(size_t n, size_t offset, fill_t how)
+{
+	fill(x_buf, N_MAX + MAX_OFFSET, how);
+	const uint16_t* x = &x_buf[offset];
+	check(dsp_sum_u16(x, n) == dsp_sum_u16_ref(x, n), "sum", n, offset, how);
+	check(dsp_sumsq_u16(x, n) == dsp_sumsq_u16_ref(x, n), "sumsq", n, offset, how);
+	dsp_stats_t s, s_ref;
+	dsp_stats_u16(x, n, &s);
+	dsp_stats_u16_ref(x, n, &s_ref);
+	check(s.sum == s_ref.sum && s.sumsq == s_ref.sumsq &&
+		  s.min == s_ref.min && s.max == s_ref.max, "stats", n, offset, how);
+}
+
+static void test_accumulate(size_t n, size_t offset, fill_t how)
+// The accumulators start near the top of the lanes, so that the sums wrap.
+{
+	fill(x_buf, N_MAX + MAX_OFFSET, how);
+	for (size_t j=0; j < N_MAX + MAX_OFFSET; ++j) {
+		acc_a[j] = acc_b[j] = (uint16_t)(0xffff - (rng() & 0x0fff));
+	}
+	dsp_accumulate_u16(&acc_a[offset], &x_buf[offset], n);
+	dsp_accumulate_u16_ref(&acc_b[offset], &x_buf[offset], n);
+	check(memcmp(acc_a, acc_b, sizeof(acc_a)) == 0, "acc", n, offset, how);
+}
+
+static void test_bin_sum(size_t n, size_t offset, fill_t how)
+// With 4095 in every sample, 16-sample bins sum to 65520, the edge of 16 bits.
+{
+	if (how == FILL_MAX_EXACT) return; // the bin sums would not fit in 16 bits
+	fill(x_buf, N_MAX + MAX_OFFSET, how);
+	for (unsigned factor=1; factor <= 16; factor *= 2) {
+		size_t nbins = n / factor;
+		memset(out_a, 0x55, sizeof(out_a));
+		memset(out_b, 0x55, sizeof(out_b));
+		dsp_bin_sum_u16(&out_a[offset], &x_buf[offset], nbins, factor);
+		dsp_bin_sum_u16_ref(&out_b[offset], &x_buf[offset], nbins, factor);
+		check(memcmp(out_a, out_b, sizeof(out_a)) == 0, "bin", n, offset, how);
+	}
+}
+
+static void test_dark_subtract(size_t n, size_t offset, fill_t how)
+// The dark frame is random, so some samples are above it (clipped to zero)
+// and some below. Also done in place, as the reader does.
+{
+	fill(x_buf, N_MAX + MAX_OFFSET, how);
+	fill(dark_buf, N_MAX + MAX_OFFSET, FILL_RANDOM);
+	memset(out_a, 0x55, sizeof(out_a));
+	memset(out_b, 0x55, sizeof(out_b));
+	dsp_dark_subtract_u16(&out_a[offset], &dark_buf[offset], &x_buf[offset], n);
+	dsp_dark_subtract_u16_ref(&out_b[offset], &dark_buf[offset], &x_buf[offset], n);
+	check(memcmp(out_a, out_b, sizeof(out_a)) == 0, "dark", n, offset, how);
+	memcpy(acc_a, x_buf, sizeof(acc_a));
+	dsp_dark_subtract_u16(&acc_a[offset], &dark_buf[offset], &acc_a[offset], n);
+	check(memcmp(&acc_a[offset], &out_b[offset], n*sizeof(uint16_t)) == 0, "dark in place", n, offset, how);
+}
+
+int main()
+{
+	static const size_t lengths[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 15, 16, 17, 31, 33,
+									 127, 1001, 3797, 3798, 3799, N_MAX};
+	for (size_t i=0; i < sizeof(lengths)/sizeof(lengths[0]); ++i) {
+		for (size_t offset=0; offset <= MAX_OFFSET; ++offset) {
+			for (int how=0; how < N_FILLS; ++how) {
+				test_reductions(lengths[i], offset, (fill_t)how);
+				test_accumulate(lengths[i], offset, (fill_t)how);
+				test_bin_sum(lengths[i], offset, (fill_t)how);
+				test_dark_subtract(lengths[i], offset, (fill_t)how);
+			}
+		}
+	}
+	printf("%d checks, %d failures\n", n_checks, n_failures);
+	return (n_failures == 0) ? 0 : 1;
+}